@@ -0,0 +1,19 @@
+#!/bin/sh
+# Headless benchmark sweep over frame sizes, maximum delays and the eight
+# horizontal/vertical, reverse and symmetric combinations, printing one JSON
+# line per run:
+#   ./bench.sh > results.jsonl
+#   ./bench.sh video.avi > results.jsonl   (frames from a file, at its size)
+
+BIN=${BIN:-./time-delays}
+FRAMES=${FRAMES:-600}
+SIZES=${SIZES:-"640x360 1280x720 1920x1080"}
+DELAYS=${DELAYS:-"30 150"}
+
+for size in $SIZES; do
+	for delay in $DELAYS; do
+		for mode in h hs hr hrs v vs vr vrs; do
+			"$BIN" --bench --size "$size" --delay "$delay" --mode "$mode" --frames "$FRAMES" "$@" | grep '^{'
+		done
+	done
+done
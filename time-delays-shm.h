@@ -0,0 +1,186 @@
+/*
+ * This file is part of Time Delays.
+ *
+ * Copyright © 2015-2018 Robin Lamarche-Perrin and Bruno Pace
+ * (<Robin.Lamarche-Perrin@lip6.fr>)
+ *
+ * Time Delays is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * Time Delays is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ * Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Shared-memory output of Time Delays, and a reader for other local
+ * processes (C or C++, compiled with gcc or clang; link with -lrt on older
+ * glibc).
+ *
+ * Each output with a sharedOutputName publishes its displayed frames (8-bit
+ * BGR, as shown in its window) in a POSIX shared memory object of that name:
+ * a header, then a ring of TD_SHM_SLOTS slots, each one starting on a page.
+ * Time Delays never waits for readers: a reader that falls behind skips
+ * frames, and a frame that is overwritten while being read is detected by
+ * the sequence number of its slot, which is odd while it is written.
+ *
+ *	td_reader reader;
+ *	if (td_open (&reader, "/time-delays") != 0) { ... }
+ *	td_frame frame;
+ *	while (...) {
+ *		if (td_read (&reader, pixels, &frame) == 1) { ... frame.width, frame.height, frame.skipped ... }
+ *	}
+ *	td_close (&reader);
+ *
+ * td_latest and td_valid read frames in place instead, without any copy.
+ */
+
+#ifndef TIME_DELAYS_SHM_H
+#define TIME_DELAYS_SHM_H
+
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define TD_SHM_MAGIC 0x48534454 /* "TDSH" */
+#define TD_SHM_VERSION 1
+#define TD_SHM_SLOTS 4
+
+/* Slot of the ring: frame n (from 1) is in slot (n - 1) % slots, and its
+   sequence is 2n once written, 2n - 1 while being written */
+typedef struct
+{
+	uint64_t sequence;
+	uint32_t width, height, step; /* step: bytes from one row to the next */
+	uint32_t reserved;
+	double time; /* capture time of the newest camera frame it shows, in seconds of CLOCK_MONOTONIC */
+	uint64_t offset; /* of the pixels, from the start of the object */
+} td_slot;
+
+typedef struct
+{
+	uint32_t magic, version;
+	uint32_t slots, maxWidth, maxHeight;
+	uint32_t reserved;
+	uint64_t slotBytes, size; /* capacity of a slot, size of the whole object */
+	uint64_t latest; /* number of the last frame written (0: none yet) */
+	td_slot slot [TD_SHM_SLOTS];
+} td_header;
+
+typedef struct
+{
+	uint64_t number; /* of the frame, from 1 */
+	uint64_t skipped; /* frames published since the one read before, and not read */
+	uint32_t width, height, step;
+	double time;
+} td_frame;
+
+typedef struct
+{
+	int fd;
+	const td_header *header;
+	uint64_t last; /* number of the last frame read */
+} td_reader;
+
+
+/* Map the shared output name (e.g. "/time-delays") for reading. Returns 0, or
+   -1 if it does not exist (yet) or is not a Time Delays output. */
+static inline int td_open (td_reader *reader, const char *name)
+{
+	struct stat st;
+	void *base;
+	reader->header = NULL;
+	reader->last = 0;
+
+	reader->fd = shm_open (name, O_RDONLY, 0);
+	if (reader->fd == -1) { return -1; }
+
+	if (fstat (reader->fd, &st) == -1 || (size_t) st.st_size < sizeof (td_header)) { close (reader->fd); return -1; }
+	base = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, reader->fd, 0);
+	if (base == MAP_FAILED) { close (reader->fd); return -1; }
+
+	reader->header = (const td_header *) base;
+	if (reader->header->magic != TD_SHM_MAGIC || reader->header->version != TD_SHM_VERSION || reader->header->size != (uint64_t) st.st_size) {
+		munmap (base, st.st_size);
+		close (reader->fd);
+		reader->header = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+
+static inline void td_close (td_reader *reader)
+{
+	if (! reader->header) { return; }
+	munmap ((void *) reader->header, reader->header->size);
+	close (reader->fd);
+	reader->header = NULL;
+}
+
+
+/* Whether frame, as returned by td_latest, has not been overwritten yet */
+static inline int td_valid (const td_reader *reader, const td_frame *frame)
+{
+	const td_slot *slot = &reader->header->slot[(frame->number - 1) % reader->header->slots];
+	__atomic_thread_fence (__ATOMIC_ACQUIRE);
+	return __atomic_load_n (&slot->sequence, __ATOMIC_RELAXED) == 2 * frame->number;
+}
+
+
+/* The newest frame, in place: its pixels, and its description in frame.
+   Returns NULL if there is no new frame since the last one read. The pixels
+   can be overwritten at any time: the frame is only whole if td_valid still
+   holds once done with them. */
+static inline const uint8_t *td_latest (td_reader *reader, td_frame *frame)
+{
+	const td_header *header = reader->header;
+	while (1)
+	{
+		const uint64_t latest = __atomic_load_n (&header->latest, __ATOMIC_ACQUIRE);
+		if (latest == 0 || latest == reader->last) { return NULL; }
+
+		const td_slot *slot = &header->slot[(latest - 1) % header->slots];
+		if (__atomic_load_n (&slot->sequence, __ATOMIC_ACQUIRE) != 2 * latest) { continue; } /* overwritten since */
+
+		frame->number = latest;
+		frame->skipped = reader->last && latest > reader->last + 1 ? latest - reader->last - 1 : 0;
+		frame->width = slot->width;
+		frame->height = slot->height;
+		frame->step = slot->step;
+		frame->time = slot->time;
+		const uint8_t *pixels = (const uint8_t *) header + slot->offset;
+		if (! td_valid (reader, frame)) { continue; }
+
+		reader->last = latest;
+		return pixels;
+	}
+}
+
+
+/* Copy the newest frame into pixels (at least maxWidth * maxHeight * 3
+   bytes, rows frame.step apart). Returns 1 if a new frame was copied, 0 if
+   there is none since the last one read. */
+static inline int td_read (td_reader *reader, uint8_t *pixels, td_frame *frame)
+{
+	const uint64_t previous = reader->last;
+	while (1)
+	{
+		const uint8_t *shared = td_latest (reader, frame);
+		if (! shared) { return 0; }
+		memcpy (pixels, shared, (size_t) frame->height * frame->step);
+		if (td_valid (reader, frame)) { return 1; }
+		reader->last = previous; /* overwritten while copied: take a newer one */
+	}
+}
+
+#endif
@@ -1,4 +1,4 @@
-// -*- compile-command: g++ -Wall -O3 -pthread time-delays.cpp -o time-delays `pkg-config --cflags --libs opencv`; -*-
+// -*- compile-command: g++ -Wall -O3 -pthread time-delays.cpp -o time-delays `pkg-config --cflags --libs opencv` -lrt; -*-
 
 /*
  * This file is part of Time Delays.
@@ -31,12 +31,37 @@
 
 #include <iostream>
 #include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <deque>
+#include <algorithm>
+#include <vector>
+#include <map>
+#include <atomic>
+#include <csignal>
+#include <cerrno>
 #include <sys/time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/videodev2.h>
 #include <pthread.h>
+#include <sched.h>
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23 // Linux 5.14, missing from older headers
+#endif
 
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 
+#include "time-delays-shm.h"
+
 unsigned int camId = 0;
 unsigned int maxDelay = 150;
 unsigned int initDelay = 120;
@@ -45,20 +70,64 @@ double switchingTime = 0;
 bool fromFile = false;
 std::string inputFileName = "";
 
+// Headless benchmark (--bench): synthetic frames unless an input file is
+// given, no window nor recording, and one JSON line of results on stdout once
+// benchFrames frames have been displayed
+bool benchmark = false;
+unsigned int benchFrames = 600;
+
+// Offline rendering (--render) of an input file to outputFileName (or
+// rawOutputName), as fast as possible: the file is decoded once, and output
+// frame n is composited and post-processed by worker n % renderThreads (0: one
+// per core), then recorded in order. Output is the same as in real time.
+bool render = false;
+unsigned int renderThreads = 0;
+
+// Latency of each stage: summaries printed every statsPeriod seconds (0:
+// never), and every frame written to traceFileName if set, as a Chrome trace
+// (chrome://tracing, Perfetto) if it ends with .json, as CSV otherwise
+const double statsPeriod = 10;
+std::string traceFileName = "";
+
 bool toFile = false;
 std::string outputFileName = "out.avi";
+std::string rawOutputName = ""; // if set, write raw BGR frames to this file or named pipe (or to the input of a command starting with '|') instead of encoding
+
+// Also publish displayed frames in a POSIX shared memory ring of this name
+// (e.g. "/time-delays"), for other local processes to read in place with
+// time-delays-shm.h. Readers never make display wait: they skip frames.
+std::string sharedOutputName = "";
+
+// Recording runs in its own thread behind a queue of recordDepth frames. When
+// the encoder falls behind, DROP skips frames and BLOCK slows the whole
+// pipeline down. File input always blocks, as nothing is lost by waiting.
+enum RecordPolicy { DROP, BLOCK };
+const RecordPolicy recordPolicy = DROP;
+const unsigned int recordDepth = 8;
+
+std::string mapFileName = ""; // grayscale image driving the delay of each pixel (IMAGE pattern)
 
 const bool initBlackScreen = false;
 const bool initHeterogeneousDelay = true;
 const bool initVertical = false;
 const bool initReverse = false;
 const bool initSymmetric = false;
+
+enum Pattern { LINEAR, RADIAL, DIAGONAL, IMAGE };
+const Pattern initPattern = LINEAR;
 const bool useSymmetric = false;
 
 unsigned int frameWidth =  1920; // 640 (cam1)   1280 (cam2)   1024 (cam3)
 unsigned int frameHeight = 1080; // 360 (cam1)    720 (cam2)    768 (cam3)
 const float exposure = 0.05;
 
+// Capture cameras through V4L2 rather than OpenCV: frames are dequeued from
+// memory-mapped driver buffers and converted or decoded straight into their
+// ring slot, then timed by the kernel. Falls back to OpenCV on failure.
+const bool useV4L2 = false;
+const unsigned int v4l2BufferNb = 4;
+unsigned int decodeThreads = 0; // MJPG decoders of V4L2 capture (0: one per core, 1: decode in the capture thread)
+
 const bool flipFrame = true;
 
 const bool cropBorder = false;
@@ -80,55 +149,705 @@ const bool resizeFrame = true;
 const unsigned int windowWidth = 1920;
 const unsigned int windowHeight = 1080;
 
+// Windows are shown by a presenter thread at refreshRate, that of the
+// projector: each refresh shows the latest post-processed frame of every
+// output, so frames replaced in between are dropped, and the last one stays
+// on screen when none is new. Capture and compositing never wait for it.
+const double refreshRate = 60;
+
+// Scale frames once at capture down to the resolution they are displayed at
+// (the window, after zoom or border removal), so that the ring holds, and
+// compositing and post-processing move, no more pixels than are shown. Needs
+// resizeFrame.
+const bool ingestScaling = false;
+
+// Pixel format of the ring buffer and of composited frames. YUV420 (planar
+// I420) takes half the memory and bandwidth of BGR, and needs even frame
+// sizes. GRAY (8-bit luma) takes a third, for pieces in black and white, and
+// RGB565 (16-bit packed colour) two thirds. Compositing moves pixels as they
+// are stored, and they are converted back to BGR once per displayed frame,
+// so maxDelay can grow in proportion for the same memory.
+enum StorageFormat { BGR, YUV420, GRAY, RGB565 };
+const char *storageNames [] = { "BGR", "YUV420", "GRAY", "RGB565" };
+StorageFormat storageFormat = BGR;
+
+// Keep for each delay only the part of the past frames that some future
+// output still shows, instead of whole frames: for banded delays, this halves
+// the memory of the ring while the layout holds. Changing it (delay, pattern
+// or orientation) briefly holds parts of the old and new levels together, up
+// to the memory of the full ring, and copies their history: see buildLevels.
+const bool bandRetention = false;
+
+// Keep the ring in a memory-mapped file on a fast local disk (e.g.
+// "/mnt/ssd/time-delays.ring") rather than in RAM, for histories longer than
+// memory allows. Compositing reads the mapped pages in place. Each new frame
+// is written back at once, and the bands of the frame ringReadAhead frames
+// ahead are prefetched. Horizontal bands then only need a couple of frames
+// worth of disk bandwidth per frame; vertical bands and maps read a little of
+// every page of every frame, so their history still has to fit in RAM.
+std::string ringFileName = "";
+const unsigned int ringReadAhead = 3;
+
+// Ring slots and working frames are carved from one arena, allocated and
+// touched once at startup, so that running neither allocates nor faults pages
+// in. It can be backed by huge pages, for fewer TLB misses when compositing
+// walks across the whole ring: HUGETLB_PAGES takes pages reserved with
+// vm.nr_hugepages, and falls back to TRANSPARENT_HUGE_PAGES, which the kernel
+// grants when it can.
+enum HugePages { NO_HUGE_PAGES, TRANSPARENT_HUGE_PAGES, HUGETLB_PAGES };
+const HugePages hugePages = TRANSPARENT_HUGE_PAGES;
+
+// Delays are counted in frames, as they come in. With timedDelay (or
+// --timed), every frame keeps its capture time and bands show the frame
+// captured nearest to the age they stand for, counted in frames at
+// nominalFps, so that delays hold in seconds whatever rate the camera
+// actually delivers. The ring then keeps maxDelay frames at maxFps, by
+// default (0) the rate of the file, or the one negotiated with the camera,
+// which is asked for cameraFps: a 60 fps camera doubles its memory. Band
+// retention counts frames.
+bool timedDelay = false;
+const double nominalFps = 30;
+const double cameraFps = 60;
+double maxFps = 0;
+
 const bool parallelComputation = true;
+unsigned int composeThreads = 0; // threads sharing the compositing of each frame (0: one per core)
+const unsigned int pipelineDepth = 2; // frames that capture may run ahead of compositing
+
+// More outputs of the same capture ring, e.g. one per projector. Each one is
+// composited and displayed by its own threads, in its own window or to its
+// own recording (when toFile), the cost of capture and the ring being shared.
+// The first output is the one set up above and driven by the keyboard.
+struct OutputSettings
+{
+	const char *window;
+	unsigned int delay; // 0: as the first output
+	bool heterogeneousDelay, vertical, reverse, symmetric;
+	Pattern pattern;
+	bool cropFrame;
+	double zoom;
+	const char *outputFileName, *rawOutputName; // as above, when recording
+	const char *sharedOutputName; // as above
+};
+
+const std::vector<OutputSettings> extraOutputs = {
+	// { "webcam-delays-2", 0, true, true, true, false, LINEAR, false, 1, "out-2.avi", "", "" },
+	// { "webcam-delays-3", 60, false, false, false, false, LINEAR, false, 1, "out-3.avi", "", "/time-delays-3" },
+};
+
+// Remote control, e.g. from a lighting desk: OSC messages (or the same as
+// plain text lines) received over UDP on controlPort (0: none). Listening on
+// "0.0.0.0" accepts them from the network, not only from this computer.
+const unsigned int controlPort = 0;
+const std::string controlAddress = "127.0.0.1";
 
 
 bool stop = false;
-bool blackScreen = initBlackScreen;
+
+// Settings of the first output until outputs are set up, then the view that
+// the layout generators (updateLayout) are building a layout for
 bool heterogeneousDelay = initHeterogeneousDelay;
 bool vertical = initVertical;
 bool reverse = initReverse;
 bool symmetric = initSymmetric;
+Pattern pattern = initPattern;
 unsigned int delay;
-unsigned int startDelay;
 
 cv::VideoCapture cam;
-cv::VideoWriter video;
+
+// V4L2 capture: the device, its memory-mapped buffers and negotiated format
+struct MappedBuffer
+{
+	void *start;
+	size_t length;
+};
+
+int v4l2Device = -1;
+std::vector<MappedBuffer> v4l2Buffers;
+unsigned int v4l2Format, v4l2Stride;
+double v4l2Fps = 0;
+
+// With ingest scaling, the ring holds frames of frameWidth x frameHeight,
+// scaled from frames of captureWidth x captureHeight
+unsigned int captureWidth, captureHeight;
+bool scaledIngest = false;
+
+cv::Mat capturedFrame; // BGR, at capture size
+cv::Mat scaledFrame; // BGR, at ring size, before conversion to the storage format
 cv::Mat *frameArray;
-cv::Mat finalFrame;
 
-unsigned int newDelay;
-unsigned int displayDelay;
+// Layout of a frame in the storage format: the bytes of pixel (r, c) of a
+// plane start at offset + (r >> shift) * step + (c >> shift) * pixelSize
+struct Plane
+{
+	size_t offset, step, pixelSize;
+	unsigned int shift;
+};
+
+std::vector<Plane> planes;
+
+// Disk-backed ring: the mapped file, with slots ringSlotBytes apart
+int ringFile = -1;
+uchar *ringBase = NULL;
+size_t ringSlotBytes;
+bool ringPunch = true;
+
+// Frame arena: frames are carved from arenaBase until arenaSize is used up,
+// then allocated on the heap
+uchar *arenaBase = NULL;
+size_t arenaSize = 0, arenaUsed = 0;
+
+// Where the source of a span stores a plane: pixel (r, c) of the plane is at
+// data + (r - firstRow) * step + (c - firstCol) * pixelSize. Sources are the
+// frames at each offset after currentDelay, or the levels of band retention.
+struct Source
+{
+	const uchar *data;
+	size_t step;
+	unsigned int firstRow, firstCol;
+};
 
-unsigned int currentDelay;
-cv::Mat *currentFrame;
-cv::Vec3b *currentPixel;
+std::vector<Source> sources;
 
+// With band retention, the pixels of box for the last age+1 frames, frame n
+// being in slices[n % (age+1)], for the spans of the layout that show frames
+// age frames older than the newest one
+struct Level
+{
+	unsigned int age;
+	cv::Rect box;
+	std::vector<Plane> planes;
+	std::vector<cv::Mat> slices;
+};
+
+// With band retention, what the source of a span is: the frame age frames
+// older than the newest one, as stored in levels[level]
+struct Retained
+{
+	unsigned int level, age;
+};
+
+std::vector<Level> levels;
+std::vector<Retained> retained;
+unsigned long retainedNb = 0;
+unsigned int retainedSlot;
+
+unsigned int ringSize;
+unsigned int newDelay;
+
+// Capture time (in seconds) and number of the frame in each ring slot, and
+// the number of frames kept behind each new one for timed delays. Arrival
+// times are on the monotonic clock, for files too, to measure latency.
+double *frameTimes, *arrivalTimes;
+unsigned long *frameNumbers;
+unsigned long capturedNb = 0;
+unsigned int historySize;
+double sourceFps;
 unsigned int workingDelay;
-cv::Mat *workingFrame;
-cv::Vec3b *workingPixel;
 
 unsigned int rowSize, colSize;
 
+// Delay map: for each pixel of the composited frame, the number of slots after
+// currentDelay of the frame it is taken from. Patterns are map generators;
+// the map is compiled into strips and spans that a single kernel gathers.
+cv::Mat delayMap;
+cv::Mat mapImage;
+
+// Columns [firstCol, lastCol) of a strip, taken from the frame offset slots
+// after currentDelay, which is stored in sources[source * planes.size()]
+struct Span
+{
+	unsigned int firstCol, lastCol;
+	unsigned int offset;
+	unsigned int source;
+};
+
+bool sameSpan (const Span &a, const Span &b) { return a.firstCol == b.firstCol && a.lastCol == b.lastCol && a.offset == b.offset; }
+
+// Rows [firstRow, lastRow) of the composited frame, which all share the same
+// spans. Strips and spans tile the whole frame without overlapping, so that
+// compositing writes every output pixel exactly once.
+struct Strip
+{
+	unsigned int firstRow, lastRow;
+	std::vector<Span> spans;
+};
+
+// Layout the generators build, one at a time, before it is copied to its output
+std::vector<Strip> layout;
+pthread_mutex_t layoutMutex = PTHREAD_MUTEX_INITIALIZER;
+
+cv::Mat blackScreenFrame;
+
 void *status;
 pthread_attr_t attr;
 pthread_t frameThread;
-pthread_t displayThread;
-pthread_t computeThread;
 
 
-void *computeVertical (void *arg);
-void *computeVerticalSymmetric (void *arg);
-void *computeVerticalReverse (void *arg);
-void *computeVerticalReverseSymmetric (void *arg);
-void *computeHorizontal (void *arg);
-void *computeHorizontalSymmetric (void *arg);
-void *computeHorizontalSymmetricBis (void *arg);
-void *computeHorizontalReverse (void *arg);
-void *computeHorizontalReverseSymmetric (void *arg);
+// Bounded blocking queue passing work between the pipeline stages. Closing it
+// wakes every waiting thread: push then fails, pop drains what is left.
+template <typename T>
+struct BoundedQueue
+{
+	std::deque<T> items;
+	unsigned int capacity;
+	bool closed;
+	pthread_mutex_t mutex;
+	pthread_cond_t notEmpty;
+	pthread_cond_t notFull;
+
+	BoundedQueue (unsigned int c) : capacity (c), closed (false)
+	{
+		pthread_mutex_init (&mutex, NULL);
+		pthread_cond_init (&notEmpty, NULL);
+		pthread_cond_init (&notFull, NULL);
+	}
+
+	bool push (const T &item)
+	{
+		pthread_mutex_lock (&mutex);
+		while (! closed && items.size() >= capacity) { pthread_cond_wait (&notFull, &mutex); }
+		bool ok = ! closed;
+		if (ok) { items.push_back (item); pthread_cond_signal (&notEmpty); }
+		pthread_mutex_unlock (&mutex);
+		return ok;
+	}
+
+	bool tryPop (T &item)
+	{
+		pthread_mutex_lock (&mutex);
+		bool ok = ! items.empty();
+		if (ok) { item = items.front(); items.pop_front(); pthread_cond_signal (&notFull); }
+		pthread_mutex_unlock (&mutex);
+		return ok;
+	}
+
+	bool pop (T &item)
+	{
+		pthread_mutex_lock (&mutex);
+		while (! closed && items.empty()) { pthread_cond_wait (&notEmpty, &mutex); }
+		bool ok = ! items.empty();
+		if (ok) { item = items.front(); items.pop_front(); pthread_cond_signal (&notFull); }
+		pthread_mutex_unlock (&mutex);
+		return ok;
+	}
+
+	void close ()
+	{
+		pthread_mutex_lock (&mutex);
+		closed = true;
+		pthread_cond_broadcast (&notEmpty);
+		pthread_cond_broadcast (&notFull);
+		pthread_mutex_unlock (&mutex);
+	}
+};
+
+
+// Offline rendering: output frames composited and post-processed by the
+// render workers, one job per frame in flight. Worker i owns job i, so the
+// output frames n with n % renderThreads == i, and takes them from
+// renderQueues[i].
+struct RenderJob
+{
+	unsigned int slot;
+	const std::vector<Strip> *layout;
+	std::vector<Source> sources;
+	cv::Mat composed, converted, output;
+	std::vector<unsigned short> lines[2];
+	bool done;
+};
+
+RenderJob *renderJobs;
+BoundedQueue<RenderJob *> **renderQueues;
+pthread_t *renderWorkers;
+pthread_mutex_t renderMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t renderDone = PTHREAD_COND_INITIALIZER;
+
+
+// Pooled MJPG decoding: the capture thread copies each compressed frame out
+// of its driver buffer into a job, which a decoder thread decodes straight
+// into the ring slot of the frame. Capture then hands the slots over in
+// order, with decodeAhead more frames being decoded in the slots after.
+struct DecodeJob
+{
+	std::vector<uchar> data;
+	cv::Mat decoded; // before scaling or conversion to the storage format
+	cv::Mat scaled;
+	unsigned int slot;
+	double time;
+	bool done, ok;
+};
+
+DecodeJob *decodeJobs;
+BoundedQueue<DecodeJob *> *decodeQueue = NULL;
+pthread_t *decodeWorkers;
+pthread_mutex_t decodeMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t decodeDone = PTHREAD_COND_INITIALIZER;
+unsigned int decodeAhead = 0;
+
+// Compositing workers: each frame is split into composeThreads stripes of
+// rows, always given to the same threads, the compositing thread itself doing
+// the first one. Outputs take turns to use them, one frame at a time.
+pthread_t *composeWorkers;
+pthread_mutex_t poolMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t workMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t workStart = PTHREAD_COND_INITIALIZER;
+pthread_cond_t workDone = PTHREAD_COND_INITIALIZER;
+unsigned long workGeneration = 0;
+unsigned int workPending = 0;
+cv::Mat *workFrame;
+const std::vector<Strip> *workLayout;
+const std::vector<Source> *workSources;
+
+// Display mapping: zoom, flip, crop, border removal and resizing only move
+// pixels along each axis, so they reduce to one list of taps per axis. An
+// output pixel at (r, c) blends the source rows and columns of rowTaps[r] and
+// columnTaps[c], with weights in 1/256 summing to 256, or less where a tap
+// falls in a cropped area.
+struct Tap
+{
+	unsigned int index0, index1, weight0, weight1;
+};
+
+// Display mapping of cols x rows frames, with the crop and zoom it was built for
+struct DisplayMap
+{
+	std::vector<Tap> rowTaps, columnTaps;
+	int cols, rows;
+	bool cropFrame;
+	double zoom;
+	bool nearestColumns; // every column takes one whole source pixel, or none
+};
+
+// Settings of an output that the keyboard (for the first output) and the
+// remote control change. Compositing works on a snapshot of them, which it
+// takes between frames.
+struct Controls
+{
+	unsigned int delay, startDelay;
+	bool blackScreen, heterogeneousDelay, vertical, reverse, symmetric;
+	Pattern pattern;
+	bool cropFrame;
+	unsigned int fades; // requests to fade out, or back in, so far
+};
+
+// What an output shows: its controls as compositing last took them, and how
+// they play out. switchingTime switches the mode of all outputs.
+struct View : Controls
+{
+	double zoom, fadeOut, fadeRate;
+	double modeTime; // since the last switch of mode, in video time for files
+};
+
+// A composited frame, with the display settings it was composited with
+struct Composed
+{
+	cv::Mat frame;
+	bool cropFrame;
+	double fadeOut;
+	double arrivalTime; // of the newest frame it shows
+	unsigned long frameNumber; // capture number of the newest frame it shows
+};
+
+// A displayed frame on its way to the recording thread
+struct Recorded
+{
+	cv::Mat frame;
+	unsigned long frameNumber;
+};
+
+const unsigned int freshSnapshot = 4; // flag of the middle snapshot (or presented frame) when it has not been taken
+
+// An output of the ring, composited, displayed and recorded by threads of its
+// own, which only share the ring, the compositing workers and the layout
+// generators with the other outputs
+struct Output
+{
+	std::string window, outputFileName, rawOutputName, sharedOutputName;
+	View view;
+
+	// Controls as last set, under controlMutex, and their snapshots, triple
+	// buffered: writers fill the back one and swap it with the middle one,
+	// which compositing swaps with the front one when it is fresh. Neither
+	// side ever waits for the other.
+	Controls controls, snapshots[3];
+	unsigned int back, front;
+	std::atomic<unsigned int> middle;
+
+	// Compositing: the layout of the view and its sources, and reused output
+	// buffers: one being composited, pipelineDepth waiting in the display
+	// queue and one being displayed
+	std::vector<Strip> layout;
+	View layoutView; // that the layout was built for
+	bool layoutValid;
+	std::vector<Source> sources;
+	unsigned int currentDelay;
+	cv::Mat frames [pipelineDepth + 2];
+	unsigned int frameIndex;
+	struct timeval lastTime;
+	double lastFrameTime;
+
+	// Display, into displayedFrame, which uses the memory of the back display
+	// buffer for its largest size. Displayed frames are triple buffered for
+	// the presenter, as controls are for compositing: each one is published
+	// as the middle one, which the presenter swaps with the front one it
+	// shows. Frames published again before being taken are dropped.
+	DisplayMap map;
+	Composed composed;
+	cv::Mat convertedFrame, displayedFrame, displayBuffers[3], presented[3];
+	double arrivalTimes[3];
+	unsigned long frameNumbers[3];
+	unsigned int presentBack, presentFront;
+	std::atomic<unsigned int> presentMiddle;
+	unsigned long shownFrames, droppedFrames, repeatedFrames;
+	std::vector<unsigned short> lines[2];
+
+	// Displayed frames waiting to be recorded, and the buffers they are copied
+	// into, recycled by the recording thread
+	BoundedQueue<Recorded> recordQueue;
+	BoundedQueue<cv::Mat> freeRecords;
+	FILE *rawOutput;
+	cv::VideoWriter video;
+	unsigned long droppedRecords;
+
+	// Shared memory ring of displayed frames, if any
+	td_header *shared;
+
+	// Ring slots of captured frames waiting to be composited, and composited
+	// frames waiting to be displayed. Capture writes a slot before pushing it
+	// to every output, so with queues of pipelineDepth slots it runs at most
+	// pipelineDepth+1 frames ahead of compositing, which itself runs at most
+	// pipelineDepth+1 frames ahead of display. A ring of
+	// maxDelay+2*(pipelineDepth+1) frames thus never overwrites a frame that
+	// compositing may still read, nor a ring slot that is handed to display
+	// as is, whatever the number of outputs.
+	BoundedQueue<unsigned int> frameQueue;
+	BoundedQueue<Composed> displayQueue;
+	pthread_t composeThread, displayThread, recordThread;
+
+	Output (const std::string &w, const View &v, const std::string &file, const std::string &raw, const std::string &shm) :
+		window (w), outputFileName (file), rawOutputName (raw), sharedOutputName (shm), view (v), controls (v), back (0), front (1), middle (2), layoutValid (false), frameIndex (0), lastFrameTime (-1),
+		presentBack (0), presentFront (1), presentMiddle (2), shownFrames (0), droppedFrames (0), repeatedFrames (0),
+		recordQueue (recordDepth), freeRecords (recordDepth), rawOutput (NULL), droppedRecords (0), shared (NULL),
+		frameQueue (pipelineDepth), displayQueue (pipelineDepth)
+	{
+		lastTime.tv_sec = lastTime.tv_usec = 0;
+		map.cols = map.rows = -1;
+		for (unsigned int i = 0; i < 3; i++) { arrivalTimes[i] = 0; frameNumbers[i] = 0; }
+	}
+};
+
+std::vector<Output *> outputs;
+bool presenting = false; // windows are shown by the presenter thread
+std::atomic<bool> presentDone (false);
+pthread_t presentThread;
+pthread_mutex_t controlMutex = PTHREAD_MUTEX_INITIALIZER; // between the keyboard, the remote control and mode switching
+
+int controlSocket = -1;
+std::atomic<bool> controlDone (false);
+pthread_t controlThread;
+
+// Histogram of the latency of a stage, in microseconds: exact below 16 us,
+// then 16 buckets per power of two (at most 6% wide). A stage is run by a
+// single thread, so adding is a relaxed load and store, and any thread can
+// read counts without locking.
+struct Histogram
+{
+	static const unsigned int BUCKETS = 40 * 16;
+	std::atomic<unsigned long> counts [BUCKETS];
+	unsigned long periodCounts [BUCKETS]; // counts at the start of the current period
+
+	static unsigned int bucket (unsigned long us)
+	{
+		if (us < 16) { return us; }
+		unsigned int e = 63 - __builtin_clzl (us);
+		unsigned int b = (e - 3) * 16 + ((us >> (e - 4)) & 15);
+		return b < BUCKETS ? b : BUCKETS - 1;
+	}
+
+	static double middle (unsigned int b)
+	{
+		if (b < 16) { return b; }
+		return (16 + b % 16 + 0.5) * (1UL << (b / 16 - 1));
+	}
+
+	void add (unsigned long us)
+	{
+		std::atomic<unsigned long> &count = counts[bucket (us)];
+		count.store (count.load (std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	}
+
+	void reset ()
+	{
+		for (unsigned int b = 0; b < BUCKETS; b++) { counts[b] = 0; periodCounts[b] = 0; }
+	}
+
+	// p50, p95 and p99 in milliseconds of the values added during the current
+	// period (then starting a new one), or since the start. Returns their number.
+	unsigned long summary (double *percentiles, bool period)
+	{
+		unsigned long values [BUCKETS], total = 0;
+		for (unsigned int b = 0; b < BUCKETS; b++)
+		{
+			unsigned long count = counts[b].load (std::memory_order_relaxed);
+			values[b] = period ? count - periodCounts[b] : count;
+			if (period) { periodCounts[b] = count; }
+			total += values[b];
+		}
+
+		const double ranks [3] = { 0.5, 0.95, 0.99 };
+		for (unsigned int i = 0; i < 3; i++)
+		{
+			unsigned long rank = std::max (1.0, ceil (ranks[i] * total)), seen = 0;
+			unsigned int b = 0;
+			while (b < BUCKETS - 1 && seen + values[b] < rank) { seen += values[b]; b++; }
+			percentiles[i] = total ? middle (b) / 1000 : 0;
+		}
+		return total;
+	}
+};
+
+// Per-frame timings on their way to the trace file: each stage has its own
+// single-producer ring, drained by the trace thread. Stages drop events
+// rather than ever wait for the file.
+struct TraceEvent
+{
+	unsigned long frame; // capture number of the frame
+	double start, end;
+};
+
+struct TraceRing
+{
+	static const unsigned int SIZE = 1024;
+	TraceEvent events [SIZE];
+	std::atomic<unsigned long> head, tail;
+	unsigned long dropped;
+
+	void push (const TraceEvent &event)
+	{
+		unsigned long h = head.load (std::memory_order_relaxed);
+		if (h - tail.load (std::memory_order_acquire) >= SIZE) { dropped++; return; }
+		events[h % SIZE] = event;
+		head.store (h + 1, std::memory_order_release);
+	}
 
-void *displayFrame (void *arg);
-void *getFrame (void *arg);
+	bool pop (TraceEvent &event)
+	{
+		unsigned long t = tail.load (std::memory_order_relaxed);
+		if (t == head.load (std::memory_order_acquire)) { return false; }
+		event = events[t % SIZE];
+		tail.store (t + 1, std::memory_order_release);
+		return true;
+	}
+};
+
+// PRESENT is not the time of a stage but the latency from capture to the
+// refresh that shows a frame
+enum Stage { CAPTURE, COMPOSE, POSTPROCESS, DISPLAY, ENCODE, PRESENT, STAGES };
+const char *stageNames [STAGES] = { "capture", "compose", "postprocess", "display", "encode", "present" };
+Histogram latencies [STAGES];
+unsigned long stageFrames [STAGES]; // runs of each stage, also counted by its own thread only
+TraceRing traceRings [STAGES];
+FILE *traceFile = NULL;
+std::atomic<bool> traceDone (false);
+double originTime;
+pthread_t traceThread;
+
+
+std::vector<Plane> framePlanes (unsigned int width, unsigned int height);
+cv::Mat newFrame (unsigned int width, unsigned int height);
+cv::Mat newBlackFrame ();
+void copyBox (cv::Mat &dst, const std::vector<Plane> &dstPlanes, const cv::Rect &dstBox, const cv::Mat &src, const std::vector<Plane> &srcPlanes, const cv::Rect &srcBox, const cv::Rect &rect);
+
+void updateLayout (Output &output);
+void compileDelayMap ();
+void setSources (unsigned int slot, unsigned int startDelay, std::vector<Source> &sources);
+unsigned int oldestSlot (unsigned int slot, unsigned int startDelay);
+unsigned int slotBehind (unsigned int slot, unsigned int age);
+unsigned int slotAt (unsigned int slot, double age);
+void compositeLayout (cv::Mat &frame, const std::vector<Strip> &layout, const std::vector<Source> &sources);
+void compositeRows (cv::Mat &frame, const std::vector<Strip> &layout, const std::vector<Source> &sources, unsigned int firstRow, unsigned int lastRow);
+void startComposeWorkers ();
+void *composeWorker (void *arg);
+
+void openRingFile ();
+void openArena (size_t size, size_t lazy);
+void *warmLoop (void *arg);
+size_t arenaBytes (int rows, int cols, int type);
+cv::Mat arenaMat (int rows, int cols, int type);
+void recycleSlot (unsigned int slot);
+void prefetchSources (const Output &output, unsigned int slot);
+
+void retainFrame (unsigned int slot);
+void buildLevels (unsigned int startDelay);
+unsigned int sliceOf (long frame, unsigned int age);
+bool covers (const std::vector<cv::Rect> &rects, const cv::Rect &box);
+
+void addBand (unsigned int firstRow, unsigned int lastRow, unsigned int firstCol, unsigned int lastCol);
+void computeProfile (float (*profile) (unsigned int r, unsigned int c));
+float radialProfile (unsigned int r, unsigned int c);
+float diagonalProfile (unsigned int r, unsigned int c);
+float imageProfile (unsigned int r, unsigned int c);
+
+void computeVertical ();
+void computeVerticalSymmetric ();
+void computeVerticalReverse ();
+void computeVerticalReverseSymmetric ();
+void computeHorizontal ();
+void computeHorizontalSymmetric ();
+void computeHorizontalSymmetricBis ();
+void computeHorizontalReverse ();
+void computeHorizontalReverseSymmetric ();
+
+bool getFrame (unsigned int slot);
+void scaleIngest ();
+void ingestFrame (const cv::Mat &captured, cv::Mat &frame, cv::Mat &scaled);
+void storeBGR (const cv::Mat &bgr, cv::Mat &frame);
+void loadBGR (const cv::Mat &frame, cv::Mat &bgr);
+bool openV4L2 (unsigned int id);
+bool readV4L2 (unsigned int slot, double &captureTime);
+bool grabV4L2 (std::vector<uchar> &data, double &captureTime);
+void startDecoders ();
+void stopDecoders ();
+void *decodeLoop (void *arg);
+bool decodeFrame (unsigned int slot, double &captureTime);
+bool decodeJPEG (const cv::Mat &encoded, cv::Mat &frame);
+void closeV4L2 ();
+void yuyvToI420 (const uchar *yuyv, cv::Mat &frame);
+void composeFrame (Output &output, unsigned int slot, Composed &composed);
+bool switchMode (View &view);
+void switchOrientation (Controls &controls);
+void displayFrame (Output &output);
+void *presentLoop (void *arg);
+void presentFrame (Output &output);
+void controlKey (int key);
+void publishControls (Output &output);
+void applyControls (Output &output);
+void openControl ();
+void *controlLoop (void *arg);
+void controlMessage (const std::string &message, double value, bool hasValue);
+void mapFrame (const DisplayMap &map, double fadeOut, const cv::Mat &frame, cv::Mat &output, std::vector<unsigned short> *lines);
+void buildDisplayMap (Output &output, int cols, int rows, bool cropFrame);
+void mapAxis (std::vector<Tap> &taps, unsigned int outSize, unsigned int size, unsigned int zoomStart, double cropStart, double cropEnd, unsigned int screenSize, unsigned int borderSize, bool mirror, unsigned int pixelSize);
+
+void *captureLoop (void *arg);
+void *composeLoop (void *arg);
+void *displayLoop (void *arg);
+void *recordLoop (void *arg);
+void renderFile ();
+void *renderLoop (void *arg);
+void openRecorder (Output &output, int codec, double fps);
+void recordFrame (Output &output, const cv::Mat &frame, unsigned long frameNumber);
+void openShared (Output &output, unsigned int cols, unsigned int rows);
+void shareFrame (Output &output, const cv::Mat &frame, double time);
+void closeShared (Output &output);
+
+double monotonicTime ();
+void stageDone (Stage stage, unsigned long frame, double start);
+void printLatencies ();
+void *traceLoop (void *arg);
+void syntheticFrame (cv::Mat &frame);
+void printBenchmark (double seconds);
 
 
 std::string type2str (int type) {
@@ -157,11 +876,42 @@ std::string type2str (int type) {
 
 int main (int argc, char *argv[])
 {
-	if (argc > 1 && strlen (argv[1]) == 1) { camId = atoi(argv[1]); fromFile = false; }
-	if (argc > 1 && strlen (argv[1]) > 1) { inputFileName = argv[1]; fromFile = true; }
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (arg == "--bench") { benchmark = true; }
+		else if (arg == "--render") { render = true; }
+		else if (arg == "--timed") { timedDelay = true; }
+		else if (arg == "--frames" && i+1 < argc) { benchFrames = atoi (argv[++i]); }
+		else if (arg == "--size" && i+1 < argc) { sscanf (argv[++i], "%ux%u", &frameWidth, &frameHeight); }
+		else if (arg == "--delay" && i+1 < argc) { maxDelay = atoi (argv[++i]); }
+		else if (arg == "--trace" && i+1 < argc) { traceFileName = argv[++i]; }
+		else if (arg == "--storage" && i+1 < argc) {
+			std::string name = argv[++i]; // e.g. "yuv420", "gray"
+			std::transform (name.begin(), name.end(), name.begin(), ::toupper);
+			int format = std::find (storageNames, storageNames + 4, name) - storageNames;
+			if (format == 4) { std::cout << "-> UNKNOWN STORAGE FORMAT " << argv[i] << std::endl; exit(-1); }
+			storageFormat = (StorageFormat) format;
+		}
+		else if (arg == "--mode" && i+1 < argc) {
+			std::string mode = argv[++i]; // e.g. "h", "vr", "vrs"
+			vertical = mode.find ('v') != std::string::npos;
+			reverse = mode.find ('r') != std::string::npos;
+			symmetric = mode.find ('s') != std::string::npos;
+		}
+		else if (arg.size() == 1) { camId = atoi(argv[i]); fromFile = false; }
+		else if (arg.size() > 1) { inputFileName = argv[i]; fromFile = true; }
+	}
 	// if (argc > 2) { maxDelay = atoi(argv[2]); }
 	// if (argc > 3) { switchingTime = atof(argv[3]); }
 
+	if (benchmark) { toFile = false; render = false; }
+	if (render && ! fromFile) { std::cout << "-> RENDERING NEEDS AN INPUT FILE" << std::endl; exit(-1); }
+	if (render) { toFile = true; } // also when band retention renders in real time
+	if (render && bandRetention) { std::cout << "-> BAND RETENTION RENDERS IN REAL TIME" << std::endl; render = false; }
+	originTime = monotonicTime();
+	if (maxDelay < 2) { std::cout << "-> MAXIMUM DELAY TOO SHORT" << std::endl; exit(-1); }
+
 	if (fromFile) {
 		cam = cv::VideoCapture (inputFileName);
 		std::cout << "OPENING FILE " << inputFileName << std::endl;
@@ -171,690 +921,2703 @@ int main (int argc, char *argv[])
 		frameHeight = cam.get (CV_CAP_PROP_FRAME_HEIGHT);
 	}
 
-	else {
+	else if (! benchmark && useV4L2 && openV4L2 (camId)) {}
+
+	else if (! benchmark) {
 		cam.open (camId);
 		std::cout << "OPENING CAM " << camId << std::endl;
 		if (! cam.isOpened()) std::cout << "-> CAN NOT FOUND" << std::endl;
 
 		cam.set (CV_CAP_PROP_FOURCC, CV_FOURCC('M','J','P','G'));
-		cam.set (CV_CAP_PROP_FPS, 60);
+		cam.set (CV_CAP_PROP_FPS, cameraFps);
 		// cam.set (CV_CAP_PROP_AUTO_EXPOSURE, 0.25);
 		// cam.set (CV_CAP_PROP_EXPOSURE, exposure);
 		cam.set (CV_CAP_PROP_FRAME_WIDTH, frameWidth);
 		cam.set (CV_CAP_PROP_FRAME_HEIGHT, frameHeight);
 	}
 
-    double fps = cam.get (CV_CAP_PROP_FPS);
-	double currentWidth = cam.get (CV_CAP_PROP_FRAME_WIDTH);
-	double currentHeight = cam.get (CV_CAP_PROP_FRAME_HEIGHT);
-	double exposure = cam.get (CV_CAP_PROP_EXPOSURE);
-	std::cout << "width: " << currentWidth << " pixels / height: " << currentHeight << " pixels / exposure: " << exposure << " / fps: " << fps << std::endl;
-
-	if (toFile) {
-		int codec = static_cast<int> (cam.get (CV_CAP_PROP_FOURCC));
-		char strCodec [] = {(char) (codec & 0XFF) , (char) ((codec & 0XFF00) >> 8), (char) ((codec & 0XFF0000) >> 16), (char) ((codec & 0XFF000000) >> 24), 0};
-		video.open (outputFileName, codec, fps, cv::Size (frameWidth, frameHeight), true);
-		std::cout << "OPENING FILE " << outputFileName << std::endl;
-		if (! video.isOpened()) std::cout << "-> FILE NOT FOUND" << std::endl;
-		std::cout << "Input codec type: " << strCodec << std::endl;
+    double fps = v4l2Device >= 0 ? v4l2Fps : cam.get (CV_CAP_PROP_FPS);
+	if (v4l2Device < 0) {
+		double currentWidth = cam.get (CV_CAP_PROP_FRAME_WIDTH);
+		double currentHeight = cam.get (CV_CAP_PROP_FRAME_HEIGHT);
+		double exposure = cam.get (CV_CAP_PROP_EXPOSURE);
+		std::cout << "width: " << currentWidth << " pixels / height: " << currentHeight << " pixels / exposure: " << exposure << " / fps: " << fps << std::endl;
 	}
-	
-	double time = 0;
-	double subtime = 0;
-	struct timeval startTime, endTime;
-	gettimeofday (&startTime, NULL);
 
 	unsigned int frameNb = 0;
-	unsigned int subframeNb = 0;
 
-	delay = initDelay;
+	delay = std::min (initDelay, maxDelay); // --delay may be shorter
 	std::cout << "DELAY: " << (delay-1) << std::endl;
 	
-	if (fromFile) delay = maxDelay;
-	startDelay = delay;
+	if (fromFile || benchmark) delay = maxDelay;
+
+	// The first output shows the settings above, the others extraOutputs
+	View view;
+	view.delay = view.startDelay = delay;
+	view.blackScreen = initBlackScreen;
+	view.heterogeneousDelay = heterogeneousDelay;
+	view.vertical = vertical; view.reverse = reverse; view.symmetric = symmetric;
+	view.pattern = pattern;
+	view.cropFrame = cropFrame;
+	view.fades = 0;
+	view.zoom = zoom; view.fadeOut = fadeOut; view.fadeRate = fadeRate;
+	view.modeTime = 0;
+	outputs.push_back (new Output ("webcam-delays", view, outputFileName, rawOutputName, sharedOutputName));
+	for (unsigned int i = 0; i < extraOutputs.size(); i++)
+	{
+		const OutputSettings &settings = extraOutputs[i];
+		View extra = view;
+		if (settings.delay > 0) { extra.delay = extra.startDelay = std::min (settings.delay, maxDelay); }
+		extra.heterogeneousDelay = settings.heterogeneousDelay;
+		extra.vertical = settings.vertical; extra.reverse = settings.reverse; extra.symmetric = settings.symmetric;
+		extra.pattern = settings.pattern;
+		extra.cropFrame = settings.cropFrame; extra.zoom = settings.zoom;
+		outputs.push_back (new Output (settings.window, extra, settings.outputFileName, settings.rawOutputName, settings.sharedOutputName));
+	}
+
+	if (outputs.size() > 1 && (bandRetention || render)) {
+		std::cout << "-> " << (bandRetention ? "BAND RETENTION" : "RENDERING") << " USES THE FIRST OUTPUT ONLY" << std::endl;
+		while (outputs.size() > 1) { delete outputs.back(); outputs.pop_back(); }
+	}
+
+	if (toFile) {
+		int codec = static_cast<int> (cam.get (CV_CAP_PROP_FOURCC));
+		for (unsigned int i = 0; i < outputs.size(); i++) { openRecorder (*outputs[i], codec, fps); }
+	}
+
+	// Files and synthetic frames are timed by their own rate, not by how fast
+	// they are read
+	sourceFps = nominalFps;
+	if (fromFile && cam.get (CV_CAP_PROP_FPS) > 0) { sourceFps = cam.get (CV_CAP_PROP_FPS); }
+	if (maxFps == 0) { maxFps = (fromFile || benchmark) ? sourceFps : (fps > 0 ? fps : cameraFps); }
+
+	if (timedDelay && bandRetention) {
+		std::cout << "-> BAND RETENTION COUNTS FRAMES, NOT USING TIMED DELAY" << std::endl;
+		timedDelay = false;
+	}
 	
+	captureWidth = frameWidth;
+	captureHeight = frameHeight;
+	if (ingestScaling && ! resizeFrame) { std::cout << "-> INGEST SCALING NEEDS resizeFrame" << std::endl; }
+	else if (ingestScaling) { scaleIngest(); }
+
+	if (storageFormat == YUV420 && (frameWidth % 2 || frameHeight % 2)) {
+		std::cout << "-> YUV420 NEEDS EVEN FRAME SIZES, USING BGR" << std::endl;
+		storageFormat = BGR;
+	}
+
+	planes = framePlanes (frameWidth, frameHeight);
+
+	// With band retention, the ring only stages captured frames until they are
+	// composited, and then retained in levels
 	newDelay = 0;
-	frameArray = new cv::Mat [maxDelay+2];
+	historySize = timedDelay ? std::max ((double) maxDelay, ceil (maxDelay * maxFps / nominalFps)) : maxDelay;
+	// Pooled decoding writes up to decodeAhead frames further ahead
+	if (v4l2Device >= 0 && v4l2Format == V4L2_PIX_FMT_MJPEG && parallelComputation) {
+		if (decodeThreads == 0) { decodeThreads = std::max (1L, sysconf (_SC_NPROCESSORS_ONLN)); }
+		decodeAhead = decodeThreads - 1;
+	}
+
+	// Rendering keeps renderThreads frames in flight instead
+	if (render && renderThreads == 0) { renderThreads = std::max (1L, sysconf (_SC_NPROCESSORS_ONLN)); }
+
+	if (bandRetention) { ringSize = pipelineDepth + 2 + decodeAhead; }
+	else if (render) { ringSize = historySize + renderThreads + 1; }
+	else { ringSize = historySize + 2 * (pipelineDepth + 1) + decodeAhead; }
+	frameArray = new cv::Mat [ringSize];
+	frameTimes = new double [ringSize];
+	arrivalTimes = new double [ringSize];
+	frameNumbers = new unsigned long [ringSize];
+
+	cv::Mat frame = newFrame (frameWidth, frameHeight);
+	std::cout << "ring: " << ringSize << " frames / " << (((size_t) ringSize * frame.total() * frame.elemSize()) >> 20) << " MB" << std::endl;
+	if (ringFileName != "") { openRingFile(); }
+
+	// Display is at most the size of the window, or of the frame if it is not
+	// resized, and triple buffered when presented. Storage formats other than
+	// BGR need BGR frames for capture and display.
+	presenting = ! toFile && ! benchmark && ! render;
+	const unsigned int displayCols = resizeFrame ? windowWidth : frameWidth;
+	const unsigned int displayRows = resizeFrame ? windowHeight : frameHeight;
+	const unsigned int displayBufferNb = presenting ? 3 : 1;
+	const size_t frameSize = arenaBytes (frame.rows, frame.cols, frame.type());
+	const size_t bgrSize = arenaBytes (frameHeight, frameWidth, CV_8UC3);
+	const size_t captureSize = arenaBytes (captureHeight, captureWidth, CV_8UC3);
+	const unsigned int decodeJobNb = decodeAhead > 0 ? decodeThreads : 0;
+
+	size_t arenaNeeded = frameSize + outputs.size() * ((pipelineDepth + 2) * frameSize + displayBufferNb * arenaBytes (displayRows, displayCols, CV_8UC3));
+	if (ringFileName == "") { arenaNeeded += ringSize * frameSize; }
+	if (storageFormat != BGR || scaledIngest) { arenaNeeded += (1 + decodeJobNb) * captureSize; }
+	if (storageFormat != BGR && scaledIngest) { arenaNeeded += (1 + decodeJobNb) * bgrSize; }
+	if (storageFormat != BGR) { arenaNeeded += outputs.size() * bgrSize; }
+	if (render) { arenaNeeded += renderThreads * (frameSize + arenaBytes (displayRows, displayCols, CV_8UC3) + (storageFormat != BGR ? bgrSize : 0)); }
+	openArena (arenaNeeded, ringFileName == "" ? ringSize * frameSize : 0);
+
+	if (ringFileName == "") { for (unsigned int i = 0; i < ringSize; i++) { frameArray[i] = newFrame (frameWidth, frameHeight); } }
+	if (storageFormat != BGR || scaledIngest) { capturedFrame = arenaMat (captureHeight, captureWidth, CV_8UC3); }
+	if (storageFormat != BGR && scaledIngest) { scaledFrame = arenaMat (frameHeight, frameWidth, CV_8UC3); }
+	for (unsigned int o = 0; o < outputs.size(); o++)
+	{
+		Output &output = *outputs[o];
+		if (storageFormat != BGR) { output.convertedFrame = arenaMat (frameHeight, frameWidth, CV_8UC3); }
+		for (unsigned int i = 0; i < displayBufferNb; i++) { output.displayBuffers[i] = arenaMat (displayRows, displayCols, CV_8UC3); }
+		for (unsigned int i = 0; i < pipelineDepth + 2; i++) { output.frames[i] = newFrame (frameWidth, frameHeight); }
+	}
+	blackScreenFrame = newBlackFrame();
+
 	rowSize = ((float) frameHeight / (float) maxDelay);
 	colSize = ((float) frameWidth / (float) maxDelay);
 	std::cout << "cols: " << colSize << " pixels / rows: " << rowSize << " pixels" << std::endl;
 
+	delayMap = cv::Mat (frameHeight, frameWidth, CV_16UC1);
+	if (mapFileName != "") {
+		mapImage = cv::imread (mapFileName, cv::IMREAD_GRAYSCALE);
+		std::cout << "OPENING FILE " << mapFileName << std::endl;
+		if (mapImage.empty()) std::cout << "-> FILE NOT FOUND" << std::endl;
+		else cv::resize (mapImage, mapImage, cv::Size (frameWidth, frameHeight));
+	}
+
 	borderWidth = round (frameWidth * borderWidthRatio / 2) * 2;
 	screenWidth = (frameWidth - borderWidth) / 2;
 	borderHeight = round (frameHeight * borderHeightRatio / 2) * 2;
 	screenHeight = (frameHeight - borderHeight) / 2;
 
 
-	while (newDelay < maxDelay+1)
+	// Cameras are shown from their first frame: until the ring has filled,
+	// delays reach back to the oldest frame captured so far. Files and
+	// benchmarks fill it first, so that their output always shows full
+	// delays, and a faster camera needs more frames to cover maxDelay at
+	// nominalFps.
+	const bool preroll = fromFile || benchmark;
+	const unsigned int initFrames = preroll ? maxDelay + 1 : 1;
+	while (frameNb < initFrames || (preroll && timedDelay && frameNb < historySize+1 && frameTimes[frameNb-1] - frameTimes[0] < (maxDelay-1) / nominalFps))
 	{
-		cam.read (frameArray[newDelay]);
+		getFrame (newDelay);
 
-		if (newDelay == 0)
+		if (frameNb == 0)
 		{
 			std::string ty =  type2str (frameArray[newDelay].type());
 			printf ("matrix: %s %dx%d \n", ty.c_str(), frameArray[newDelay].cols, frameArray[newDelay].rows);
 		}
 
+		// The last frame is retained when it is composited
+		if (bandRetention && frameNb + 1 < initFrames) { retainFrame (newDelay); }
+
 		newDelay++;
+		if (newDelay >= ringSize) { newDelay = 0; }
 		frameNb++;
-		std::cout << "init: " << (round(((double)frameNb)/(maxDelay+1)*100)) << "%\r" << std::flush;
+		if (preroll) { std::cout << "init: " << (round(((double)frameNb)/(maxDelay+1)*100)) << "%\r" << std::flush; }
 	}
-	std::cout << std::endl;
+	if (preroll) { std::cout << std::endl; }
 
-	if (! toFile) {
-		cv::namedWindow("webcam-delays", CV_WINDOW_NORMAL);
-		cv::setWindowProperty ("webcam-delays", CV_WND_PROP_FULLSCREEN, 1);
-	}	
-		
-	while (!stop)
+	if (! render) { startComposeWorkers(); }
+
+	for (unsigned int o = 0; o < outputs.size(); o++)
 	{
-		// Measure time
-		gettimeofday (&endTime, NULL);
-		double deltaTime = (endTime.tv_sec - startTime.tv_sec) + (float) (endTime.tv_usec - startTime.tv_usec) / 1000000L;
-		startTime = endTime;
+		Output &output = *outputs[o];
+		if (! toFile && ! benchmark) {
+			cv::namedWindow (output.window, CV_WINDOW_NORMAL);
+			cv::setWindowProperty (output.window, CV_WND_PROP_FULLSCREEN, 1);
+		}
 
-		time += deltaTime;
-		subtime += deltaTime;
+		if (toFile) {
+			for (unsigned int i = 0; i < recordDepth; i++) { output.freeRecords.push (cv::Mat()); }
+			int t = pthread_create (&output.recordThread, NULL, recordLoop, &output);
+			if (t) { std::cout << "Error: unable to create thread " << t << std::endl; exit(-1); }
+		}
 
-		frameNb++;
-		subframeNb++;
+		if (output.sharedOutputName != "" && ! benchmark && ! render) { openShared (output, displayCols, displayRows); }
+	}
 
-		if (subtime >= 3)
-		{
-			std::cout << "CAM: " << (int) (((float) subframeNb) / subtime) << "fps" << std::endl;
-			subtime = 0;
-			subframeNb = 0;
-		}
+	if (controlPort > 0 && ! benchmark && ! render) { openControl(); }
 
-		if (fadeRate != 0) {
-			fadeOut += fadeRate * deltaTime;
-			if (fadeOut > 1) { fadeOut = 1; fadeRate = 0; }
-			if (fadeOut < 0) { fadeOut = 0; fadeRate = 0; }
-		}
-			
-		if (newDelay >= maxDelay+2) { newDelay = 0; }
-		
-		displayDelay = newDelay+1 + (maxDelay - startDelay);
-		while (displayDelay >= maxDelay+2) { displayDelay -= (maxDelay + 2); }
+	// Only time the running pipeline, not the init loop
+	for (unsigned int s = 0; s < STAGES; s++) { latencies[s].reset(); stageFrames[s] = 0; }
+	double startTime = monotonicTime();
 
-		currentDelay = displayDelay+1;
-		if (currentDelay >= maxDelay+2) { currentDelay -= (maxDelay + 2); }
+	if (traceFileName != "") {
+		traceFile = fopen (traceFileName.c_str(), "w");
+		std::cout << "OPENING TRACE " << traceFileName << std::endl;
+		if (! traceFile) { std::cout << "-> FILE NOT FOUND" << std::endl; exit(-1); }
+		int t = pthread_create (&traceThread, NULL, traceLoop, NULL);
+		if (t) { std::cout << "Error: unable to create thread " << t << std::endl; exit(-1); }
+	}
 
-		// Create new frame
-		if (blackScreen) { finalFrame = cv::Mat (frameHeight, frameWidth, CV_8UC3, cv::Scalar(0, 0, 0)); }
-		else {
-			finalFrame = frameArray[currentDelay].clone();
-			currentPixel = finalFrame.ptr<cv::Vec3b>(0);
-		}
+	if (presenting) {
+		int t = pthread_create (&presentThread, NULL, presentLoop, NULL);
+		if (t) { std::cout << "Error: unable to create thread " << t << std::endl; exit(-1); }
+	}
 
-		// Compute new frame
-		struct timeval start, end;
-		gettimeofday (&start, NULL);
-	
-		if (parallelComputation)
-		{
-			int t2 = pthread_create (&frameThread, NULL, getFrame, NULL);
-			if (t2) { std::cout << "Error: unable to create thread " << t2 << std::endl; exit(-1); }
+	if (render) { renderFile(); }
 
-			if (! blackScreen && heterogeneousDelay) {
-				int t3;
-				if (vertical) {
-					if (reverse) {
-						if (symmetric) { t3 = pthread_create (&computeThread, NULL, computeVerticalReverseSymmetric, NULL); }
-						else { t3 = pthread_create (&computeThread, NULL, computeVerticalReverse, NULL); }
-					} else {
-						if (symmetric) { t3 = pthread_create (&computeThread, NULL, computeVerticalSymmetric, NULL); }
-						else { t3 = pthread_create (&computeThread, NULL, computeVertical, NULL); }
-					}
-				} else {
-					if (reverse) {
-						if (symmetric) { t3 = pthread_create (&computeThread, NULL, computeHorizontalReverseSymmetric, NULL); }
-						else { t3 = pthread_create (&computeThread, NULL, computeHorizontalReverse, NULL); }
-					} else {
-						if (symmetric) { t3 = pthread_create (&computeThread, NULL, computeHorizontalSymmetric, NULL); }
-						else { t3 = pthread_create (&computeThread, NULL, computeHorizontal, NULL); }
-					}
-				}
-				if (t3) { std::cout << "Error: unable to create thread " << t3 << std::endl; exit(-1); }
+	else if (parallelComputation)
+	{
+		// Long-lived pipeline: capture of frame N+1, compositing of frame N
+		// and display of frame N-1 run at the same time, for every output.
+		// The first frame to composite is the last one of the init loop.
+		for (unsigned int o = 0; o < outputs.size(); o++) { outputs[o]->frameQueue.push ((newDelay + ringSize - 1) % ringSize); }
+		if (decodeAhead > 0) { startDecoders(); }
 
-				t3 = pthread_join (computeThread, &status);
-				if (t3) { std::cout << "Error: unable to join " << t3 << std::endl; exit(-1); }
-			}
-			
-			t2 = pthread_join (frameThread, &status);
-			if (t2) { std::cout << "Error: unable to join " << t2 << std::endl; exit(-1); }
+		int t1 = pthread_create (&frameThread, NULL, captureLoop, NULL);
+		if (t1) { std::cout << "Error: unable to create thread " << t1 << std::endl; exit(-1); }
 
-			int t1 = pthread_create (&displayThread, NULL, displayFrame, NULL);
-			if (t1) { std::cout << "Error: unable to create thread " << t1 << std::endl; exit(-1); }
+		for (unsigned int o = 0; o < outputs.size(); o++)
+		{
+			int t2 = pthread_create (&outputs[o]->composeThread, NULL, composeLoop, outputs[o]);
+			if (t2) { std::cout << "Error: unable to create thread " << t2 << std::endl; exit(-1); }
 
-			t1 = pthread_join (displayThread, &status);
-			if (t1) { std::cout << "Error: unable to join " << t1 << std::endl; exit(-1); }
+			int t3 = pthread_create (&outputs[o]->displayThread, NULL, displayLoop, outputs[o]);
+			if (t3) { std::cout << "Error: unable to create thread " << t3 << std::endl; exit(-1); }
 		}
 
-		else {
-			displayFrame (0);
-			getFrame (0);
-
-			if (! blackScreen && heterogeneousDelay) {
-				if (vertical) {
-					if (reverse) { computeVerticalReverse(0); }
-					else { computeVertical(0); }
-				} else {
-					if (reverse) { computeHorizontalReverse(0); }
-					else { computeHorizontal(0); }
-				}
-			}
+		for (unsigned int o = 0; o < outputs.size(); o++)
+		{
+			int t3 = pthread_join (outputs[o]->displayThread, &status);
+			if (t3) { std::cout << "Error: unable to join " << t3 << std::endl; exit(-1); }
+
+			int t2 = pthread_join (outputs[o]->composeThread, &status);
+			if (t2) { std::cout << "Error: unable to join " << t2 << std::endl; exit(-1); }
 		}
 
-		gettimeofday (&end, NULL);
-		displayDelay = newDelay;
-		newDelay++;
-		
+		t1 = pthread_join (frameThread, &status);
+		if (t1) { std::cout << "Error: unable to join " << t1 << std::endl; exit(-1); }
+	}
 
-		if (switchingTime > 0 && time > switchingTime)
+	else {
+		unsigned int slot = (newDelay + ringSize - 1) % ringSize;
+		while (!stop)
 		{
-			vertical = !vertical;
-			if (useSymmetric && vertical) { symmetric = !symmetric; }
-			if ((useSymmetric && vertical && symmetric) || (!useSymmetric && vertical)) { reverse = !reverse; }
-			time = 0;
+			for (unsigned int o = 0; o < outputs.size() && ! stop; o++)
+			{
+				composeFrame (*outputs[o], slot, outputs[o]->composed);
+				displayFrame (*outputs[o]);
+			}
+
+			slot = newDelay;
+			if (! getFrame (newDelay)) { break; }
+			newDelay++;
+			if (newDelay >= ringSize) { newDelay = 0; }
 		}
 	}
-	
-	return 0;
-}
-
-
 
+	if (presenting) {
+		presentDone = true;
+		int t = pthread_join (presentThread, &status);
+		if (t) { std::cout << "Error: unable to join " << t << std::endl; exit(-1); }
+		for (unsigned int o = 0; o < outputs.size(); o++) {
+			Output &output = *outputs[o];
+			std::cout << "DISPLAY: " << output.shownFrames << " frames shown in " << output.window << ", " << output.droppedFrames << " dropped, " << output.repeatedFrames << " refreshes repeated" << std::endl;
+		}
+	}
 
+	for (unsigned int o = 0; o < outputs.size() && toFile; o++)
+	{
+		Output &output = *outputs[o];
+		output.recordQueue.close();
+		int t = pthread_join (output.recordThread, &status);
+		if (t) { std::cout << "Error: unable to join " << t << std::endl; exit(-1); }
+		if (output.droppedRecords > 0) { std::cout << "RECORD: " << output.droppedRecords << " frames dropped from " << output.window << std::endl; }
+	}
 
+	if (controlSocket >= 0) {
+		controlDone = true;
+		int t = pthread_join (controlThread, &status);
+		if (t) { std::cout << "Error: unable to join " << t << std::endl; exit(-1); }
+	}
 
+	if (v4l2Device >= 0) { closeV4L2(); }
 
-void *displayFrame (void *arg)
-{
-	struct timeval start, end;
-	gettimeofday (&start, NULL);
+	if (traceFile) {
+		traceDone = true;
+		int t = pthread_join (traceThread, &status);
+		if (t) { std::cout << "Error: unable to join " << t << std::endl; exit(-1); }
+	}
 
-	if (zoom > 1) {
-		cv::Rect zoomRectangle = cv::Rect (frameWidth * ((zoom-1)/zoom) / 2, frameHeight * ((zoom-1)/zoom) / 2, frameWidth / zoom, frameHeight / zoom);
-		finalFrame = finalFrame (zoomRectangle);
+	if (benchmark) { printBenchmark (monotonicTime() - startTime); }
+	for (unsigned int o = 0; o < outputs.size(); o++)
+	{
+		if (outputs[o]->shared) { closeShared (*outputs[o]); }
+		delete outputs[o];
 	}
 	
-	if (flipFrame ) { cv::flip (finalFrame, finalFrame, 1); }
+	return 0;
+}
 
-	if (cropFrame) {
-		const cv::Rect cropRectangle = cv::Rect (frameWidth * cropLeft, frameHeight * cropTop, frameWidth * (1 - cropLeft + cropRight), frameHeight * (1 - cropTop + cropBottom));
-		cv::Mat blackFrame = cv::Mat (frameHeight * (1 - cropLeft + cropRight), frameWidth * (1 - cropTop + cropBottom), CV_8UC3, cv::Scalar(0, 0, 0));
-		finalFrame (cropRectangle).copyTo (blackFrame (cropRectangle));
-		finalFrame = blackFrame;
-	}
 
-	if (cropBorder) {
-		cv::Mat output = cv::Mat (screenHeight * 2, screenWidth * 2, CV_8UC3, cv::Scalar (0, 0, 0));
 
-		finalFrame (cv::Rect (0, 0, screenWidth, screenHeight)).copyTo (output (cv::Rect (0, 0, screenWidth, screenHeight)));
-		finalFrame (cv::Rect (screenWidth + borderWidth, 0, screenWidth, screenHeight)).copyTo (output (cv::Rect (screenWidth, 0, screenWidth, screenHeight)));
-		finalFrame (cv::Rect (0, screenHeight + borderHeight, screenWidth, screenHeight)).copyTo (output (cv::Rect (0, screenHeight, screenWidth, screenHeight)));
-		finalFrame (cv::Rect (screenWidth + borderWidth, screenHeight + borderHeight, screenWidth, screenHeight)).copyTo (output (cv::Rect (screenWidth, screenHeight, screenWidth, screenHeight)));
 
-		finalFrame = output;
+// Open the recording of output: raw frames if it has a raw output name,
+// encoded with the input codec otherwise
+void openRecorder (Output &output, int codec, double fps)
+{
+	if (! output.rawOutputName.empty()) {
+		signal (SIGPIPE, SIG_IGN);
+		if (output.rawOutputName[0] == '|') { output.rawOutput = popen (output.rawOutputName.c_str() + 1, "w"); }
+		else { output.rawOutput = fopen (output.rawOutputName.c_str(), "wb"); }
+		std::cout << "OPENING RAW OUTPUT " << output.rawOutputName << std::endl;
+		if (! output.rawOutput) { std::cout << "-> FILE NOT FOUND" << std::endl; exit(-1); }
 	}
-	
-	if (fadeOut > 0) { finalFrame.convertTo (finalFrame, -1, 1-fadeOut); }
-	if (resizeFrame) { cv::resize (finalFrame, finalFrame, cv::Size (windowWidth, windowHeight)); }
-
-	//cv::GaussianBlur (*currentFrame, *currentFrame, cv::Size(7,7), 1.5, 1.5);
-	if (toFile) { video << finalFrame; } else { cv::imshow ("webcam-delays", finalFrame); }
 
-	int key = cv::waitKey(1);
-	if (key > 0)
-	{
-		key = key & 0xFF;
-		std::cout << "KEY: " << key << std::endl;
+	else {
+		char strCodec [] = {(char) (codec & 0XFF) , (char) ((codec & 0XFF00) >> 8), (char) ((codec & 0XFF0000) >> 16), (char) ((codec & 0XFF000000) >> 24), 0};
+		output.video.open (output.outputFileName, codec, fps, resizeFrame ? cv::Size (windowWidth, windowHeight) : cv::Size (frameWidth, frameHeight), true);
+		std::cout << "OPENING FILE " << output.outputFileName << std::endl;
+		if (! output.video.isOpened()) std::cout << "-> FILE NOT FOUND" << std::endl;
+		std::cout << "Input codec type: " << strCodec << std::endl;
+	}
+}
 
-		if ((key >= 48 && key <= 57) || (key >= 176 && key <= 185)) {
-			unsigned int newDelay = 1;
-			if (key >= 48 && key <= 57) { newDelay = (key - 48) * 15 + 1; }
-			if (key >= 176 && key <= 185) { newDelay = (key - 176) * 15 + 1; }
-			if (newDelay > maxDelay) { newDelay = maxDelay; }
-			delay = newDelay;
-			startDelay = newDelay;
-			std::cout << "DELAY: " << (delay-1) << std::endl;
-		}
 
-		switch (key)
-		{
-		case 27 : // Escape
-			stop = true;
-			break;
-			
-		case 32 : // Space
-			// if (fadeOut == 0) { fadeRate = 3; }
-			// else if (fadeOut == 1) { fadeRate = -3; }
-			blackScreen = !blackScreen;
-			break;
+// Hand a copy of frame, which shows captured frame frameNumber, to the
+// recording thread of output, in a recycled buffer
+void recordFrame (Output &output, const cv::Mat &frame, unsigned long frameNumber)
+{
+	Recorded recorded;
+	if (recordPolicy == BLOCK || fromFile) { if (! output.freeRecords.pop (recorded.frame)) { return; } }
+	else if (! output.freeRecords.tryPop (recorded.frame)) { output.droppedRecords++; return; }
 
-		case 8 : // Backslash
-			if (fadeOut == 0) { fadeRate = 0.2; }
-			else if (fadeOut == 1) { fadeRate = -0.2; }
-			break;
+	frame.copyTo (recorded.frame);
+	recorded.frameNumber = frameNumber;
+	output.recordQueue.push (recorded);
+}
 
-		case 13 : case 141 : // Enter
-			heterogeneousDelay = !heterogeneousDelay;
-			delay = 120;
-			startDelay = 120;
-			break;
 
-		case 114 : // r
-			reverse = !reverse;
-			break;
+void *recordLoop (void *arg)
+{
+	Output &output = *(Output *) arg;
+	Recorded record;
+	bool failed = false;
+	unsigned long recorded = 0;
 
-		case 115 : // s
-			symmetric = !symmetric;
-			break;
+	while (output.recordQueue.pop (record))
+	{
+		const cv::Mat &frame = record.frame;
+		double start = monotonicTime();
+		if (output.rawOutput && recorded++ == 0) { std::cout << "RAW OUTPUT: " << frame.cols << "x" << frame.rows << " bgr24" << std::endl; }
+
+		if (output.rawOutput && ! failed) {
+			if (frame.isContinuous()) { failed = fwrite (frame.data, frame.total() * frame.elemSize(), 1, output.rawOutput) != 1; }
+			else for (int r = 0; r < frame.rows && ! failed; r++) { failed = fwrite (frame.ptr (r), frame.cols * frame.elemSize(), 1, output.rawOutput) != 1; }
+			if (failed) { std::cout << "-> RAW OUTPUT CLOSED" << std::endl; }
+		}
 
-		case 104 : // h
-			vertical = false;
-			break;
-			
-		case 118 : // v
-			vertical = true;
-			break;
+		else if (! output.rawOutput) { output.video << frame; }
 
-		case 99 : // c
-			cropFrame = true;
-			break;
-			
-		case 102 : // f
-			cropFrame = false;
-			break;
-			
-		case 43 : case 171 : // +
-			delay++; if (delay > maxDelay) { delay = maxDelay; }
-			startDelay = delay;
-			std::cout << "DELAY: " << (delay-1) << std::endl;
-			break;
+		if (&output == outputs[0]) { stageDone (ENCODE, record.frameNumber, start); }
+		output.freeRecords.push (frame);
+	}
 
-		case 45 : case 173 : // -
-			delay--; if (delay <= 1) { delay = 1; }
-			startDelay = delay;
-			std::cout << "DELAY: " << (delay-1) << std::endl;
-			break;
+	if (output.rawOutput && output.rawOutputName[0] == '|') { pclose (output.rawOutput); }
+	else if (output.rawOutput) { fclose (output.rawOutput); }
+	else { output.video.release(); }
 
-		// case 85 : newFocus++; if (newFocus >= 256) { newFocus = 255; } break;
-		// case 86 : newFocus--; if (newFocus < 0) { newFocus = 0; } break;
-		}
-	}
-	
-	gettimeofday (&end, NULL);
-	if (parallelComputation) { pthread_exit (NULL); }
+	return NULL;
 }
 
 
-void *getFrame (void *arg)
+// Create the shared memory ring of output, for frames of at most cols x
+// rows, replacing any one left by an earlier run: its readers keep it until
+// they open the new one. The header is marked valid once complete.
+void openShared (Output &output, unsigned int cols, unsigned int rows)
 {
-	struct timeval start, end;
-	gettimeofday (&start, NULL);
+	const size_t pageSize = sysconf (_SC_PAGESIZE);
+	const size_t headerBytes = (sizeof (td_header) + pageSize - 1) / pageSize * pageSize;
+	const size_t slotBytes = arenaBytes (rows, cols, CV_8UC3);
+	const size_t size = headerBytes + TD_SHM_SLOTS * slotBytes;
+	const char *name = output.sharedOutputName.c_str();
+
+	std::cout << "OPENING SHARED OUTPUT " << name << std::endl;
+	shm_unlink (name);
+	int fd = shm_open (name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd == -1) { std::cout << "-> SHARED MEMORY CANNOT BE CREATED" << std::endl; exit(-1); }
+	if (ftruncate (fd, size) == -1) { std::cout << "-> NOT ENOUGH SHARED MEMORY" << std::endl; exit(-1); }
+	void *base = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close (fd);
+	if (base == MAP_FAILED) { std::cout << "-> SHARED MEMORY CANNOT BE MAPPED" << std::endl; exit(-1); }
+
+	// Touch the frames now, as the arena is, rather than while displaying
+	memset (base, 0, size);
+	td_header *header = (td_header *) base;
+	header->version = TD_SHM_VERSION;
+	header->slots = TD_SHM_SLOTS;
+	header->maxWidth = cols; header->maxHeight = rows;
+	header->slotBytes = slotBytes; header->size = size;
+	for (unsigned int s = 0; s < TD_SHM_SLOTS; s++) { header->slot[s].offset = headerBytes + s * slotBytes; }
+	__atomic_store_n (&header->magic, TD_SHM_MAGIC, __ATOMIC_RELEASE);
+	output.shared = header;
+}
 
-	cam.read (frameArray[newDelay]);
-	if (frameArray[newDelay].empty()) {
-		stop = true;
-		if (parallelComputation) { pthread_exit (NULL); }
-		return NULL;
-	}
-	
-	gettimeofday (&end, NULL);
 
-	if (parallelComputation) { pthread_exit (NULL); }
+// Publish frame in the shared memory ring of output, in the slot of the
+// oldest frame. Its sequence is odd while it is written, so that readers of
+// that slot find out, without ever making display wait.
+void shareFrame (Output &output, const cv::Mat &frame, double time)
+{
+	td_header *header = output.shared;
+	const uint64_t number = header->latest + 1;
+	td_slot &slot = header->slot[(number - 1) % TD_SHM_SLOTS];
+
+	__atomic_store_n (&slot.sequence, 2 * number - 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence (__ATOMIC_RELEASE);
+	slot.width = frame.cols; slot.height = frame.rows; slot.step = frame.cols * 3;
+	slot.time = time;
+	cv::Mat shared (frame.rows, frame.cols, CV_8UC3, (uchar *) header + slot.offset);
+	frame.copyTo (shared);
+
+	__atomic_store_n (&slot.sequence, 2 * number, __ATOMIC_RELEASE);
+	__atomic_store_n (&header->latest, number, __ATOMIC_RELEASE);
 }
 
 
+// Readers that still map the ring keep it, with its last frames
+void closeShared (Output &output)
+{
+	munmap (output.shared, output.shared->size);
+	shm_unlink (output.sharedOutputName.c_str());
+	output.shared = NULL;
+}
 
 
-
-void *computeVertical (void *arg)
+// Render the input file offline. This thread decodes it into the ring and
+// steps the mode schedule, frame by frame as composeFrame would, while up to
+// renderThreads frames are being composited and post-processed. Their output
+// is recorded in order. Only the first output is rendered.
+void renderFile ()
 {
-	workingDelay = currentDelay;
-	float firstCol = ((float) frameWidth / (float) delay);
-	
-	for (unsigned int d = 1; d < delay; d++)
+	double start = monotonicTime();
+	std::cout << "render threads: " << renderThreads << std::endl;
+
+	Output &output = *outputs[0];
+	buildDisplayMap (output, frameWidth, frameHeight, output.view.cropFrame);
+	renderJobs = new RenderJob [renderThreads];
+	renderQueues = new BoundedQueue<RenderJob *> * [renderThreads];
+	renderWorkers = new pthread_t [renderThreads];
+
+	for (unsigned long i = 0; i < renderThreads; i++)
 	{
-		workingDelay++;
-		if (workingDelay >= maxDelay+2) { workingDelay = 0; }
-		workingPixel = frameArray[workingDelay].ptr<cv::Vec3b>(0);
+		renderQueues[i] = new BoundedQueue<RenderJob *> (1);
+		renderJobs[i].composed = newFrame (frameWidth, frameHeight);
+		if (storageFormat != BGR) { renderJobs[i].converted = arenaMat (frameHeight, frameWidth, CV_8UC3); }
+		renderJobs[i].output = arenaMat (output.displayedFrame.rows, output.displayedFrame.cols, CV_8UC3);
 
-		float lastCol = (d+1) * ((float) frameWidth / (float) delay);
+		int t = pthread_create (&renderWorkers[i], NULL, renderLoop, (void *) i);
+		if (t) { std::cout << "Error: unable to create thread " << t << std::endl; exit(-1); }
+	}
+
+	// Layouts of the modes met so far, which workers read while new ones are
+	// added: map nodes do not move
+	std::map<unsigned int, std::vector<Strip> > layouts;
+	const double frameNb = cam.get (CV_CAP_PROP_FRAME_COUNT);
+	unsigned int slot = (newDelay + ringSize - 1) % ringSize;
+	double lastTime = frameTimes[slot];
+	unsigned long requested = 0, returned = 0;
+	bool reading = true;
 
-		for (unsigned int c = (unsigned int) firstCol; c < (unsigned int) lastCol; c++)
+	while (reading || returned < requested)
+	{
+		if (reading && requested < returned + renderThreads)
 		{
-			unsigned int i = c;
-			for (unsigned int r = 0; r < frameHeight; r++)
-			{
-				currentPixel[i][0] = workingPixel[i][0];
-				currentPixel[i][1] = workingPixel[i][1];
-				currentPixel[i][2] = workingPixel[i][2];
-				i += frameWidth;
-			}
+			RenderJob &job = renderJobs[requested % renderThreads];
+			output.view.modeTime += frameTimes[slot] - lastTime;
+			lastTime = frameTimes[slot];
+
+			const unsigned int mode = output.view.vertical | output.view.reverse << 1 | output.view.symmetric << 2;
+			if (layouts.find (mode) == layouts.end()) { updateLayout (output); layouts[mode] = output.layout; }
+			job.layout = &layouts[mode];
+			job.slot = slot;
+			job.done = false;
+			renderQueues[requested % renderThreads]->push (&job);
+			requested++;
+			switchMode (output.view);
+
+			// Workers only read the renderThreads frames in flight and the
+			// historySize frames behind them, not the next slot
+			slot = newDelay;
+			reading = getFrame (newDelay);
+			if (reading) { newDelay++; if (newDelay >= ringSize) { newDelay = 0; } }
+			continue;
 		}
-		firstCol = lastCol;
+
+		RenderJob &job = renderJobs[returned % renderThreads];
+		pthread_mutex_lock (&renderMutex);
+		while (! job.done) { pthread_cond_wait (&renderDone, &renderMutex); }
+		pthread_mutex_unlock (&renderMutex);
+
+		recordFrame (output, job.output, frameNumbers[job.slot]);
+		returned++;
+		if (frameNb > 0) { std::cout << "render: " << (round ((returned + maxDelay) / frameNb * 100)) << "%\r" << std::flush; }
 	}
 
-	if (parallelComputation) { pthread_exit (NULL); }
+	for (unsigned int i = 0; i < renderThreads; i++)
+	{
+		renderQueues[i]->close();
+		int t = pthread_join (renderWorkers[i], NULL);
+		if (t) { std::cout << "Error: unable to join " << t << std::endl; exit(-1); }
+	}
+
+	double seconds = monotonicTime() - start;
+	std::cout << std::endl << "RENDER: " << returned << " frames in " << seconds << "s (" << (returned / seconds) << "fps)" << std::endl;
 }
 
 
-void *computeVerticalSymmetric (void *arg)
+// Render worker i: what composeFrame and displayFrame do to a frame, but for
+// the layout and into the buffers of its job
+void *renderLoop (void *arg)
 {
-	workingDelay = currentDelay + delay/2;
-	if (workingDelay >= maxDelay+2) { workingDelay -= (maxDelay+2); }	
-	float firstCol = ((float) frameWidth / (float) delay);
-	
-	for (unsigned int d = 1; d < delay/2; d++)
+	const unsigned long i = (unsigned long) arg;
+	const Output &output = *outputs[0];
+	RenderJob *job;
+
+	while (renderQueues[i]->pop (job))
 	{
-		workingDelay++;
-		if (workingDelay >= maxDelay+2) { workingDelay = 0; }
-		workingPixel = frameArray[workingDelay].ptr<cv::Vec3b>(0);
+		const unsigned int oldest = oldestSlot (job->slot, output.view.startDelay);
+		cv::Mat frame;
 
-		float lastCol = (d+1) * ((float) frameWidth / (float) delay);
+		if (output.view.blackScreen) { frame = blackScreenFrame; }
+		else if (! output.view.heterogeneousDelay) { frame = frameArray[oldest]; }
+		else {
+			setSources (job->slot, output.view.startDelay, job->sources);
+			frame = job->composed;
+			compositeRows (frame, *job->layout, job->sources, 0, frameHeight);
+		}
 
-		for (unsigned int c = (unsigned int) firstCol; c < (unsigned int) lastCol; c++)
-		{
-			unsigned int i = c;
-			for (unsigned int r = 0; r < frameHeight; r++)
+		if (storageFormat != BGR) { loadBGR (frame, job->converted); frame = job->converted; }
+		mapFrame (output.map, output.view.fadeOut, frame, job->output, job->lines);
+
+		pthread_mutex_lock (&renderMutex);
+		job->done = true;
+		pthread_cond_broadcast (&renderDone);
+		pthread_mutex_unlock (&renderMutex);
+	}
+
+	return NULL;
+}
+
+
+// Map the BGR frame into output, which has the size of the display map, in a
+// single pass, fade folded into the row weights. Source rows are
+// interpolated horizontally once, into lines, then blended.
+void mapFrame (const DisplayMap &map, double fadeOut, const cv::Mat &frame, cv::Mat &output, std::vector<unsigned short> *lines)
+{
+	int lineRows[2] = { -1, -1 };
+	const unsigned int fade = round ((1 - fadeOut) * 256);
+	const unsigned int width = output.cols * 3;
+
+	for (int r = 0; r < output.rows; r++)
+	{
+		const Tap &row = map.rowTaps[r];
+		const unsigned int weight0 = row.weight0 * fade, weight1 = row.weight1 * fade;
+		uchar *pixels = output.ptr (r);
+		if (weight0 + weight1 == 0) { memset (pixels, 0, width); continue; }
+
+		// Plain pixel moves (no scaling, partly cropped edge nor fade)
+		if (map.nearestColumns && row.weight0 == 256 && fade == 256) {
+			const uchar *input = frame.ptr (row.index0);
+			for (unsigned int c = 0; c < width; c += 3)
+			{
+				const Tap &column = map.columnTaps[c/3];
+				if (column.weight0) { memcpy (pixels + c, input + column.index0, 3); } else { memset (pixels + c, 0, 3); }
+			}
+			continue;
+		}
+
+		const int needed[2] = { (int) row.index0, (int) row.index1 };
+		if (lineRows[1] == needed[0] || lineRows[0] == needed[1]) { std::swap (lines[0], lines[1]); std::swap (lineRows[0], lineRows[1]); }
+
+		for (unsigned int l = 0; l < 2; l++)
+		{
+			if (lineRows[l] == needed[l]) { continue; }
+			lineRows[l] = needed[l];
+			lines[l].resize (width);
+
+			const uchar *input = frame.ptr (needed[l]);
+			unsigned short *line = lines[l].data();
+			for (unsigned int c = 0; c < width; c += 3)
+			{
+				const Tap &column = map.columnTaps[c/3];
+				for (unsigned int k = 0; k < 3; k++) { line[c+k] = input[column.index0+k] * column.weight0 + input[column.index1+k] * column.weight1; }
+			}
+		}
+
+		const unsigned short *top = lines[0].data(), *bottom = lines[1].data();
+		for (unsigned int i = 0; i < width; i++) { pixels[i] = (top[i] * weight0 + bottom[i] * weight1 + (1 << 23)) >> 24; }
+	}
+}
+
+
+// Rebuild the display mapping of output for cols x rows frames, with its
+// zoom and the given crop. Crop ratios apply to the zoomed frame.
+void buildDisplayMap (Output &output, int cols, int rows, bool cropFrame)
+{
+	DisplayMap &map = output.map;
+	const double zoom = output.view.zoom;
+	map.cols = cols; map.rows = rows;
+	map.cropFrame = cropFrame; map.zoom = zoom;
+
+	unsigned int zoomCols = cols, zoomRows = rows, zoomLeft = 0, zoomTop = 0;
+	if (zoom > 1) {
+		zoomLeft = cols * ((zoom-1)/zoom) / 2; zoomCols = cols / zoom;
+		zoomTop = rows * ((zoom-1)/zoom) / 2; zoomRows = rows / zoom;
+	}
+
+	unsigned int outCols = cropBorder ? screenWidth * 2 : zoomCols;
+	unsigned int outRows = cropBorder ? screenHeight * 2 : zoomRows;
+	if (resizeFrame) { outCols = windowWidth; outRows = windowHeight; }
+
+	mapAxis (map.columnTaps, outCols, zoomCols, zoomLeft, cropFrame ? cropLeft : 0, cropFrame ? cropRight : 0, screenWidth, borderWidth, flipFrame, 3);
+	mapAxis (map.rowTaps, outRows, zoomRows, zoomTop, cropFrame ? cropTop : 0, cropFrame ? cropBottom : 0, screenHeight, borderHeight, false, 1);
+
+	map.nearestColumns = true;
+	for (unsigned int c = 0; c < outCols; c++)
+	{
+		const Tap &column = map.columnTaps[c];
+		if (column.weight1 > 0 || (column.weight0 > 0 && column.weight0 < 256)) { map.nearestColumns = false; }
+	}
+
+	output.displayedFrame = cv::Mat (outRows, outCols, CV_8UC3, output.displayBuffers[output.presentBack].data);
+}
+
+
+// Taps of one axis, from output back to source: bilinear resizing to
+// outSize, border removal, crop then mirror within the zoomed size, and the
+// zoom offset. Indexes are in units of pixelSize.
+void mapAxis (std::vector<Tap> &taps, unsigned int outSize, unsigned int size, unsigned int zoomStart, double cropStart, double cropEnd, unsigned int screenSize, unsigned int borderSize, bool mirror, unsigned int pixelSize)
+{
+	const unsigned int inSize = cropBorder ? screenSize * 2 : size;
+	taps.resize (outSize);
+
+	for (unsigned int i = 0; i < outSize; i++)
+	{
+		double position = resizeFrame ? (i + 0.5) * inSize / outSize - 0.5 : i;
+		int first = floor (position);
+		unsigned int weight = round ((position - first) * 256);
+		if (weight == 256) { first++; weight = 0; }
+		if (first < 0) { first = 0; weight = 0; }
+		if (first >= (int) inSize - 1) { first = inSize - 1; weight = 0; }
+
+		unsigned int index[2] = { (unsigned int) first, std::min ((unsigned int) first + 1, inSize - 1) };
+		bool visible[2];
+		for (unsigned int t = 0; t < 2; t++)
+		{
+			unsigned int x = index[t];
+			if (cropBorder && x >= screenSize) { x += borderSize; }
+			if (x >= size) { x = size - 1; visible[t] = false; } // screens measured on the unzoomed frame
+			else { visible[t] = x >= size * cropStart && x < size * (1 - cropEnd); }
+			if (mirror) { x = size - 1 - x; }
+			index[t] = (zoomStart + x) * pixelSize;
+		}
+
+		taps[i].index0 = index[0]; taps[i].weight0 = visible[0] ? 256 - weight : 0;
+		taps[i].index1 = index[1]; taps[i].weight1 = visible[1] ? weight : 0;
+	}
+}
+
+
+
+
+void *captureLoop (void *arg)
+{
+	while (!stop)
+	{
+		if (! getFrame (newDelay)) { break; }
+
+		bool pushed = true;
+		for (unsigned int o = 0; o < outputs.size(); o++) { pushed = outputs[o]->frameQueue.push (newDelay) && pushed; }
+		if (! pushed) { break; }
+
+		newDelay++;
+		if (newDelay >= ringSize) { newDelay = 0; }
+	}
+
+	for (unsigned int o = 0; o < outputs.size(); o++) { outputs[o]->frameQueue.close(); }
+	if (decodeQueue) { stopDecoders(); }
+	return NULL;
+}
+
+
+void *composeLoop (void *arg)
+{
+	Output &output = *(Output *) arg;
+	unsigned int slot;
+	Composed composed;
+
+	while (output.frameQueue.pop (slot))
+	{
+		composeFrame (output, slot, composed);
+		if (! output.displayQueue.push (composed)) { break; }
+	}
+
+	output.frameQueue.close();
+	output.displayQueue.close();
+	return NULL;
+}
+
+
+void *displayLoop (void *arg)
+{
+	Output &output = *(Output *) arg;
+	while (!stop && output.displayQueue.pop (output.composed)) { displayFrame (output); }
+
+	output.displayQueue.close();
+	return NULL;
+}
+
+
+// Composite the frame of output for the ring slot just captured, with the
+// controls last published. Stage timings and the capture rate are measured
+// on the first output only.
+void composeFrame (Output &output, unsigned int slot, Composed &composed)
+{
+	double start = monotonicTime();
+	applyControls (output);
+	View &view = output.view;
+	cv::Mat &frame = composed.frame;
+	const bool first = &output == outputs[0];
+
+	// Measure time
+	struct timeval endTime;
+	gettimeofday (&endTime, NULL);
+	if (output.lastTime.tv_sec == 0) { output.lastTime = endTime; }
+	double deltaTime = (endTime.tv_sec - output.lastTime.tv_sec) + (float) (endTime.tv_usec - output.lastTime.tv_usec) / 1000000L;
+	output.lastTime = endTime;
+
+	// Files switch modes in their own time, as when rendered offline
+	if (fromFile) {
+		if (output.lastFrameTime < 0) { output.lastFrameTime = frameTimes[slot]; }
+		view.modeTime += frameTimes[slot] - output.lastFrameTime;
+		output.lastFrameTime = frameTimes[slot];
+	}
+	else { view.modeTime += deltaTime; }
+
+	if (first) {
+		static double subtime = 0;
+		static unsigned int subframeNb = 0;
+		subtime += deltaTime;
+		subframeNb++;
+
+		if (subtime >= 3)
+		{
+			std::cout << "CAM: " << (int) (((float) subframeNb) / subtime) << "fps" << std::endl;
+			if (timedDelay && ! fromFile && ! benchmark && subframeNb / subtime > maxFps * 1.1) { std::cout << "-> FASTER THAN maxFps: LONGEST DELAYS ARE SHORTENED" << std::endl; }
+			subtime = 0;
+			subframeNb = 0;
+		}
+	}
+
+	if (view.fadeRate != 0) {
+		view.fadeOut += view.fadeRate * deltaTime;
+		if (view.fadeOut > 1) { view.fadeOut = 1; view.fadeRate = 0; }
+		if (view.fadeOut < 0) { view.fadeOut = 0; view.fadeRate = 0; }
+	}
+
+	output.currentDelay = oldestSlot (slot, view.startDelay);
+
+	// Retain frames even when they are not shown
+	if (bandRetention) { retainFrame (slot); }
+
+	// Display never writes into the frames it is given, so the black frame and
+	// the ring slot of a homogeneous delay are handed over without any copy
+	if (view.blackScreen) { frame = blackScreenFrame; }
+	else if (! view.heterogeneousDelay && ! bandRetention) {
+		frame = frameArray[output.currentDelay];
+		if (ringBase) { madvise (ringBase + (size_t) ((output.currentDelay + ringReadAhead) % ringSize) * ringSlotBytes, ringSlotBytes, MADV_WILLNEED); }
+	}
+	else {
+		updateLayout (output);
+		setSources (slot, view.startDelay, output.sources);
+		if (ringBase && ! bandRetention) { prefetchSources (output, slot); }
+
+		frame = output.frames[output.frameIndex];
+		output.frameIndex = (output.frameIndex + 1) % (pipelineDepth + 2);
+		compositeLayout (frame, output.layout, output.sources);
+	}
+
+	composed.cropFrame = view.cropFrame;
+	composed.fadeOut = view.fadeOut;
+	composed.arrivalTime = arrivalTimes[slot];
+	composed.frameNumber = frameNumbers[slot];
+	if (switchMode (view)) {
+		// Switch the controls too, or the next snapshot would switch back
+		pthread_mutex_lock (&controlMutex);
+		switchOrientation (output.controls);
+		publishControls (output);
+		pthread_mutex_unlock (&controlMutex);
+	}
+	if (! first) { return; }
+	stageDone (COMPOSE, composed.frameNumber, start);
+
+	static double statsTime = start;
+	if (statsPeriod > 0 && start - statsTime >= statsPeriod) { printLatencies(); statsTime = start; }
+}
+
+
+// Alternate between horizontal and vertical delays, and their variants,
+// every switchingTime seconds. Returns whether the mode was switched.
+bool switchMode (View &view)
+{
+	if (switchingTime <= 0 || view.modeTime <= switchingTime) { return false; }
+	switchOrientation (view);
+	view.modeTime = 0;
+	return true;
+}
+
+
+void switchOrientation (Controls &controls)
+{
+	controls.vertical = !controls.vertical;
+	if (useSymmetric && controls.vertical) { controls.symmetric = !controls.symmetric; }
+	if ((useSymmetric && controls.vertical && controls.symmetric) || (!useSymmetric && controls.vertical)) { controls.reverse = !controls.reverse; }
+}
+
+
+// Post-process the composited frame of output, then hand it over to the
+// presenter or record it
+void displayFrame (Output &output)
+{
+	double start = monotonicTime();
+	const bool first = &output == outputs[0];
+	const Composed &composed = output.composed;
+	cv::Mat finalFrame = composed.frame;
+
+	// finalFrame may be a ring slot: convert it into convertedFrame instead
+	if (storageFormat != BGR) { loadBGR (finalFrame, output.convertedFrame); finalFrame = output.convertedFrame; }
+
+	const DisplayMap &map = output.map;
+	if (finalFrame.cols != map.cols || finalFrame.rows != map.rows || composed.cropFrame != map.cropFrame || output.view.zoom != map.zoom) { buildDisplayMap (output, finalFrame.cols, finalFrame.rows, composed.cropFrame); }
+
+	mapFrame (map, composed.fadeOut, finalFrame, output.displayedFrame, output.lines);
+
+	finalFrame = output.displayedFrame;
+	if (first) { stageDone (POSTPROCESS, composed.frameNumber, start); }
+
+	//cv::GaussianBlur (*currentFrame, *currentFrame, cv::Size(7,7), 1.5, 1.5);
+	if (benchmark) {
+		if (stageFrames[POSTPROCESS] >= benchFrames) { stop = true; }
+		return;
+	}
+
+	if (output.shared) { shareFrame (output, finalFrame, composed.arrivalTime); }
+
+	if (presenting) {
+		// Publish the frame, and post-process the next one into the buffer
+		// given back, which the presenter is done with
+		output.presented[output.presentBack] = finalFrame;
+		output.arrivalTimes[output.presentBack] = composed.arrivalTime;
+		output.frameNumbers[output.presentBack] = composed.frameNumber;
+		unsigned int previous = output.presentMiddle.exchange (output.presentBack | freshSnapshot);
+		if (previous & freshSnapshot) { output.droppedFrames++; }
+		output.presentBack = previous & ~freshSnapshot;
+		output.displayedFrame = cv::Mat (finalFrame.rows, finalFrame.cols, CV_8UC3, output.displayBuffers[output.presentBack].data);
+		return;
+	}
+
+	start = monotonicTime();
+	recordFrame (output, finalFrame, composed.frameNumber);
+	if (first) { stageDone (DISPLAY, composed.frameNumber, start); }
+}
+
+
+// Show the latest frame of every output at each refresh, then handle keys,
+// which control the first output. Refreshes are paced on the monotonic
+// clock: after a late one, pacing starts again from it rather than rushing
+// to catch up.
+void *presentLoop (void *arg)
+{
+	const double period = 1 / refreshRate;
+	double next = monotonicTime();
+
+	while (! presentDone)
+	{
+		double start = monotonicTime();
+		for (unsigned int o = 0; o < outputs.size(); o++) { presentFrame (*outputs[o]); }
+		int key = cv::waitKey(1);
+		const Output &first = *outputs[0];
+		stageDone (DISPLAY, first.frameNumbers[first.presentFront], start);
+
+		if (key > 0)
+		{
+			key = key & 0xFF;
+			std::cout << "KEY: " << key << std::endl;
+			controlKey (key);
+		}
+
+		next += period;
+		const double now = monotonicTime();
+		if (next < now) { next = now; }
+		struct timespec t;
+		t.tv_sec = (time_t) next;
+		t.tv_nsec = (next - t.tv_sec) * 1e9;
+		clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL);
+	}
+
+	return NULL;
+}
+
+
+// Show the frame last published by output if it is new, or leave the one
+// shown on screen. Latency is measured on the first output.
+void presentFrame (Output &output)
+{
+	if (! (output.presentMiddle.load() & freshSnapshot)) {
+		if (output.shownFrames > 0) { output.repeatedFrames++; }
+		return;
+	}
+
+	output.presentFront = output.presentMiddle.exchange (output.presentFront) & ~freshSnapshot;
+	cv::imshow (output.window, output.presented[output.presentFront]);
+	output.shownFrames++;
+	if (&output == outputs[0]) { stageDone (PRESENT, output.frameNumbers[output.presentFront], output.arrivalTimes[output.presentFront]); }
+}
+
+
+// Apply a key to the controls of the first output, and publish them
+void controlKey (int key)
+{
+	Output &output = *outputs[0];
+	pthread_mutex_lock (&controlMutex);
+	Controls &controls = output.controls;
+
+	if ((key >= 48 && key <= 57) || (key >= 176 && key <= 185)) {
+		unsigned int newDelay = 1;
+		if (key >= 48 && key <= 57) { newDelay = (key - 48) * 15 + 1; }
+		if (key >= 176 && key <= 185) { newDelay = (key - 176) * 15 + 1; }
+		if (newDelay > maxDelay) { newDelay = maxDelay; }
+		controls.delay = newDelay;
+		controls.startDelay = newDelay;
+		std::cout << "DELAY: " << (controls.delay-1) << std::endl;
+	}
+
+	switch (key)
+	{
+	case 27 : // Escape
+		stop = true;
+		break;
+		
+	case 32 : // Space
+		controls.blackScreen = !controls.blackScreen;
+		break;
+
+	case 8 : // Backslash
+		controls.fades++;
+		break;
+
+	case 13 : case 141 : // Enter
+		controls.heterogeneousDelay = !controls.heterogeneousDelay;
+		controls.delay = std::min (initDelay, maxDelay);
+		controls.startDelay = controls.delay;
+		break;
+
+	case 114 : // r
+		controls.reverse = !controls.reverse;
+		break;
+
+	case 115 : // s
+		controls.symmetric = !controls.symmetric;
+		break;
+
+	case 104 : // h
+		controls.pattern = LINEAR;
+		controls.vertical = false;
+		break;
+		
+	case 118 : // v
+		controls.pattern = LINEAR;
+		controls.vertical = true;
+		break;
+
+	case 111 : // o
+		controls.pattern = RADIAL;
+		break;
+
+	case 100 : // d
+		controls.pattern = DIAGONAL;
+		break;
+
+	case 105 : // i
+		if (! mapImage.empty()) { controls.pattern = IMAGE; }
+		break;
+
+	case 99 : // c
+		controls.cropFrame = true;
+		break;
+		
+	case 102 : // f
+		controls.cropFrame = false;
+		break;
+		
+	case 43 : case 171 : // +
+		controls.delay++; if (controls.delay > maxDelay) { controls.delay = maxDelay; }
+		controls.startDelay = controls.delay;
+		std::cout << "DELAY: " << (controls.delay-1) << std::endl;
+		break;
+
+	case 45 : case 173 : // -
+		controls.delay--; if (controls.delay <= 1) { controls.delay = 1; }
+		controls.startDelay = controls.delay;
+		std::cout << "DELAY: " << (controls.delay-1) << std::endl;
+		break;
+
+	// case 85 : newFocus++; if (newFocus >= 256) { newFocus = 255; } break;
+	// case 86 : newFocus--; if (newFocus < 0) { newFocus = 0; } break;
+	}
+
+	publishControls (output);
+	pthread_mutex_unlock (&controlMutex);
+}
+
+
+// Publish the controls of output as they are now, with controlMutex held.
+// A snapshot that compositing has not taken yet is replaced.
+void publishControls (Output &output)
+{
+	output.snapshots[output.back] = output.controls;
+	output.back = output.middle.exchange (output.back | freshSnapshot) & ~freshSnapshot;
+}
+
+
+// Take the controls last published for output, if any, between two frames.
+// Fades are requested by a count, so that a request is not lost when the
+// next snapshot replaces the one carrying it.
+void applyControls (Output &output)
+{
+	if (! (output.middle.load() & freshSnapshot)) { return; }
+	output.front = output.middle.exchange (output.front) & ~freshSnapshot;
+
+	View &view = output.view;
+	const unsigned int fades = view.fades;
+	static_cast<Controls &> (view) = output.snapshots[output.front];
+
+	if (view.fades != fades) {
+		if (view.fadeOut == 0) { view.fadeRate = 0.2; }
+		else if (view.fadeOut == 1) { view.fadeRate = -0.2; }
+	}
+}
+
+
+// Listen for remote control messages on controlAddress:controlPort
+void openControl ()
+{
+	struct sockaddr_in address;
+	memset (&address, 0, sizeof (address));
+	address.sin_family = AF_INET;
+	address.sin_port = htons (controlPort);
+
+	std::cout << "OPENING CONTROL " << controlAddress << ":" << controlPort << std::endl;
+	controlSocket = socket (AF_INET, SOCK_DGRAM, 0);
+	if (controlSocket < 0 || inet_pton (AF_INET, controlAddress.c_str(), &address.sin_addr) != 1
+		|| bind (controlSocket, (struct sockaddr *) &address, sizeof (address)) < 0) { std::cout << "-> CONTROL NOT OPENED: " << strerror (errno) << std::endl; exit(-1); }
+
+	int t = pthread_create (&controlThread, NULL, controlLoop, NULL);
+	if (t) { std::cout << "Error: unable to create thread " << t << std::endl; exit(-1); }
+}
+
+
+// Remote control thread. A message is an OSC message (an address, a type tag
+// string, then big-endian arguments, each padded to 4 bytes) or a text line
+// made of an address and an optional number. Only the first argument, an
+// int32 or a float32, is read.
+void *controlLoop (void *arg)
+{
+	char packet [1024];
+	struct pollfd fd = { controlSocket, POLLIN, 0 };
+
+	while (! controlDone)
+	{
+		if (poll (&fd, 1, 100) <= 0) { continue; }
+		ssize_t size = recv (controlSocket, packet, sizeof (packet) - 1, 0);
+		if (size <= 0 || packet[0] != '/') { continue; }
+		packet[size] = 0;
+
+		std::string address;
+		double value = 0;
+		bool hasValue = false;
+
+		const size_t tagOffset = (strlen (packet) + 4) & ~3;
+		if (tagOffset < (size_t) size && packet[tagOffset] == ',') {
+			address = packet;
+			const char *tags = packet + tagOffset + 1;
+			const size_t argOffset = tagOffset + ((strlen (packet + tagOffset) + 4) & ~3);
+			if ((tags[0] == 'i' || tags[0] == 'f') && argOffset + 4 <= (size_t) size) {
+				uint32_t bits;
+				memcpy (&bits, packet + argOffset, 4);
+				bits = ntohl (bits);
+				if (tags[0] == 'i') { value = (int32_t) bits; }
+				else { float f; memcpy (&f, &bits, 4); value = f; }
+				hasValue = true;
+			}
+		}
+
+		else {
+			char text [256];
+			int fields = sscanf (packet, "%255s %lf", text, &value);
+			if (fields < 1) { continue; }
+			address = text;
+			hasValue = fields == 2;
+		}
+
+		controlMessage (address, value, hasValue);
+	}
+
+	close (controlSocket);
+	return NULL;
+}
+
+
+// Apply a remote control message to the controls of an output, and publish
+// them. Addresses may start with the index of the output, e.g. /1/delay
+// for the second output; they address the first output otherwise. Switches
+// without a value are toggled.
+void controlMessage (const std::string &message, double value, bool hasValue)
+{
+	std::cout << "CONTROL: " << message;
+	if (hasValue) { std::cout << " " << value; }
+	std::cout << std::endl;
+
+	unsigned int index = 0;
+	std::string address = message;
+	char name [256];
+	if (sscanf (message.c_str(), "/%u/%255s", &index, name) == 2) { address = std::string ("/") + name; }
+	if (index >= outputs.size()) { std::cout << "-> NO OUTPUT " << index << std::endl; return; }
+
+	Output &output = *outputs[index];
+	pthread_mutex_lock (&controlMutex);
+	Controls &controls = output.controls;
+	bool *flag = NULL;
+
+	if (address == "/delay" && hasValue) {
+		controls.delay = std::max (1.0, std::min ((double) maxDelay, round (value) + 1));
+		controls.startDelay = controls.delay;
+	}
+
+	else if (address == "/pattern" && hasValue && value >= LINEAR && value <= IMAGE) {
+		Pattern pattern = (Pattern) (int) value;
+		if (pattern != IMAGE || ! mapImage.empty()) { controls.pattern = pattern; }
+	}
+
+	else if (address == "/fade") { controls.fades++; }
+	else if (address == "/black") { flag = &controls.blackScreen; }
+	else if (address == "/heterogeneous") { flag = &controls.heterogeneousDelay; }
+	else if (address == "/vertical") { flag = &controls.vertical; }
+	else if (address == "/reverse") { flag = &controls.reverse; }
+	else if (address == "/symmetric") { flag = &controls.symmetric; }
+	else if (address == "/crop") { flag = &controls.cropFrame; }
+	else { std::cout << "-> UNKNOWN CONTROL" << std::endl; }
+
+	if (flag) { *flag = hasValue ? value != 0 : ! *flag; }
+
+	publishControls (output);
+	pthread_mutex_unlock (&controlMutex);
+}
+
+
+bool getFrame (unsigned int slot)
+{
+	double start = monotonicTime();
+
+	double captureTime = -1;
+	if (ringBase && ! decodeQueue) { recycleSlot (slot); }
+
+	if (benchmark && ! fromFile) { syntheticFrame (frameArray[slot]); }
+	else if (decodeQueue) { if (! decodeFrame (slot, captureTime)) { return false; } }
+	else if (v4l2Device >= 0) { if (! readV4L2 (slot, captureTime)) { return false; } }
+	else if (storageFormat == BGR && ! scaledIngest) {
+		cam.read (frameArray[slot]);
+		if (frameArray[slot].empty()) { return false; }
+	} else {
+		cam.read (capturedFrame);
+		if (capturedFrame.empty()) { return false; }
+		ingestFrame (capturedFrame, frameArray[slot], scaledFrame);
+	}
+
+	// Start writing the frame back now, rather than letting dirty pages pile
+	// up until the kernel stalls the capture to flush them
+	if (ringBase) { sync_file_range (ringFile, (off_t) slot * ringSlotBytes, ringSlotBytes, SYNC_FILE_RANGE_WRITE); }
+
+	frameNumbers[slot] = capturedNb;
+	arrivalTimes[slot] = captureTime >= 0 ? captureTime : monotonicTime();
+	frameTimes[slot] = (fromFile || benchmark) ? capturedNb / sourceFps : arrivalTimes[slot];
+	capturedNb++;
+	
+	stageDone (CAPTURE, frameNumbers[slot], start);
+	return true;
+}
+
+
+// Ring size for ingest scaling: each axis of the capture is scaled so that
+// the part of it that is shown (zoomed in by the largest zoom of the
+// outputs, or without borders) covers the window pixel for pixel. Sizes are
+// even, and frames are never scaled up.
+void scaleIngest ()
+{
+	double maxZoom = std::max (zoom, 1.0);
+	for (unsigned int i = 0; i < extraOutputs.size(); i++) { maxZoom = std::max (maxZoom, extraOutputs[i].zoom); }
+
+	const double shownCols = cropBorder ? captureWidth * (1 - borderWidthRatio) : captureWidth / maxZoom;
+	const double shownRows = cropBorder ? captureHeight * (1 - borderHeightRatio) : captureHeight / maxZoom;
+	frameWidth = std::min (captureWidth, (unsigned int) ceil (captureWidth * windowWidth / shownCols / 2) * 2);
+	frameHeight = std::min (captureHeight, (unsigned int) ceil (captureHeight * windowHeight / shownRows / 2) * 2);
+
+	scaledIngest = frameWidth != captureWidth || frameHeight != captureHeight;
+	std::cout << "ingest: " << captureWidth << "x" << captureHeight << " -> " << frameWidth << "x" << frameHeight << std::endl;
+}
+
+
+// Store the BGR frame captured, of capture size, into the ring slot frame:
+// scaled (area averaging) to the ring size, then converted to the storage
+// format through scaled if it is not BGR
+void ingestFrame (const cv::Mat &captured, cv::Mat &frame, cv::Mat &scaled)
+{
+	if (frame.empty()) { frame = newFrame (frameWidth, frameHeight); }
+
+	const cv::Mat *bgr = &captured;
+	if (scaledIngest) {
+		cv::Mat &target = storageFormat == BGR ? frame : scaled;
+		cv::resize (captured, target, cv::Size (frameWidth, frameHeight), 0, 0, cv::INTER_AREA);
+		bgr = &target;
+	}
+
+	if (storageFormat != BGR) { storeBGR (*bgr, frame); }
+	else if (bgr->data != frame.data) { bgr->copyTo (frame); }
+}
+
+
+// Convert a BGR frame to the storage format, and back
+void storeBGR (const cv::Mat &bgr, cv::Mat &frame)
+{
+	switch (storageFormat)
+	{
+	case YUV420 : cv::cvtColor (bgr, frame, cv::COLOR_BGR2YUV_I420); break;
+	case GRAY : cv::cvtColor (bgr, frame, cv::COLOR_BGR2GRAY); break;
+	case RGB565 : cv::cvtColor (bgr, frame, cv::COLOR_BGR2BGR565); break;
+	default : bgr.copyTo (frame);
+	}
+}
+
+
+void loadBGR (const cv::Mat &frame, cv::Mat &bgr)
+{
+	switch (storageFormat)
+	{
+	case YUV420 : cv::cvtColor (frame, bgr, cv::COLOR_YUV2BGR_I420); break;
+	case GRAY : cv::cvtColor (frame, bgr, cv::COLOR_GRAY2BGR); break;
+	case RGB565 : cv::cvtColor (frame, bgr, cv::COLOR_BGR5652BGR); break;
+	default : frame.copyTo (bgr);
+	}
+}
+
+
+int xioctl (int fd, unsigned long request, void *arg)
+{
+	int r;
+	do { r = ioctl (fd, request, arg); } while (r == -1 && errno == EINTR);
+	return r;
+}
+
+
+// Open /dev/video<id> for streaming in the first format it accepts at
+// frameWidth x frameHeight: MJPG (as asked to OpenCV), then YUYV, then I420.
+// Sets the frame size to what the device actually delivers.
+bool openV4L2 (unsigned int id)
+{
+	char device [32];
+	snprintf (device, sizeof (device), "/dev/video%u", id);
+	std::cout << "OPENING V4L2 " << device << std::endl;
+
+	v4l2Device = open (device, O_RDWR);
+	if (v4l2Device < 0) { std::cout << "-> CAN NOT FOUND" << std::endl; return false; }
+
+	struct v4l2_capability capability;
+	memset (&capability, 0, sizeof (capability));
+	if (xioctl (v4l2Device, VIDIOC_QUERYCAP, &capability) == -1 || !(capability.capabilities & V4L2_CAP_VIDEO_CAPTURE) || !(capability.capabilities & V4L2_CAP_STREAMING)) {
+		std::cout << "-> NOT A STREAMING CAPTURE DEVICE" << std::endl;
+		closeV4L2(); return false;
+	}
+
+	const unsigned int formats [3] = { V4L2_PIX_FMT_MJPEG, V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_YUV420 };
+	struct v4l2_format format;
+	bool found = false;
+	for (unsigned int f = 0; f < 3 && ! found; f++)
+	{
+		memset (&format, 0, sizeof (format));
+		format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		format.fmt.pix.width = frameWidth;
+		format.fmt.pix.height = frameHeight;
+		format.fmt.pix.pixelformat = formats[f];
+		format.fmt.pix.field = V4L2_FIELD_NONE;
+		found = xioctl (v4l2Device, VIDIOC_S_FMT, &format) == 0 && format.fmt.pix.pixelformat == formats[f]
+			&& (formats[f] != V4L2_PIX_FMT_YUV420 || format.fmt.pix.bytesperline == format.fmt.pix.width);
+	}
+	if (! found) { std::cout << "-> NO SUPPORTED PIXEL FORMAT" << std::endl; closeV4L2(); return false; }
+
+	v4l2Format = format.fmt.pix.pixelformat;
+	v4l2Stride = format.fmt.pix.bytesperline;
+	frameWidth = format.fmt.pix.width;
+	frameHeight = format.fmt.pix.height;
+
+	struct v4l2_streamparm parameters;
+	memset (&parameters, 0, sizeof (parameters));
+	parameters.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	parameters.parm.capture.timeperframe.numerator = 1;
+	parameters.parm.capture.timeperframe.denominator = cameraFps;
+	xioctl (v4l2Device, VIDIOC_S_PARM, &parameters);
+	if (parameters.parm.capture.timeperframe.numerator > 0) { v4l2Fps = (double) parameters.parm.capture.timeperframe.denominator / parameters.parm.capture.timeperframe.numerator; }
+
+	struct v4l2_requestbuffers request;
+	memset (&request, 0, sizeof (request));
+	request.count = v4l2BufferNb;
+	request.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	request.memory = V4L2_MEMORY_MMAP;
+	if (xioctl (v4l2Device, VIDIOC_REQBUFS, &request) == -1 || request.count < 2) { std::cout << "-> CAN NOT MAP BUFFERS" << std::endl; closeV4L2(); return false; }
+
+	for (unsigned int i = 0; i < request.count; i++)
+	{
+		struct v4l2_buffer buffer;
+		memset (&buffer, 0, sizeof (buffer));
+		buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		buffer.memory = V4L2_MEMORY_MMAP;
+		buffer.index = i;
+		if (xioctl (v4l2Device, VIDIOC_QUERYBUF, &buffer) == -1) { std::cout << "-> CAN NOT MAP BUFFERS" << std::endl; closeV4L2(); return false; }
+
+		MappedBuffer mapped = { mmap (NULL, buffer.length, PROT_READ | PROT_WRITE, MAP_SHARED, v4l2Device, buffer.m.offset), buffer.length };
+		if (mapped.start == MAP_FAILED) { std::cout << "-> CAN NOT MAP BUFFERS" << std::endl; closeV4L2(); return false; }
+		v4l2Buffers.push_back (mapped);
+
+		if (xioctl (v4l2Device, VIDIOC_QBUF, &buffer) == -1) { std::cout << "-> CAN NOT QUEUE BUFFERS" << std::endl; closeV4L2(); return false; }
+	}
+
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	if (xioctl (v4l2Device, VIDIOC_STREAMON, &type) == -1) { std::cout << "-> CAN NOT START STREAMING" << std::endl; closeV4L2(); return false; }
+
+	char fourcc [] = { (char) (v4l2Format & 0xFF), (char) ((v4l2Format >> 8) & 0xFF), (char) ((v4l2Format >> 16) & 0xFF), (char) ((v4l2Format >> 24) & 0xFF), 0 };
+	std::cout << "width: " << frameWidth << " pixels / height: " << frameHeight << " pixels / format: " << fourcc << " / fps: " << v4l2Fps << " / buffers: " << v4l2Buffers.size() << std::endl;
+	return true;
+}
+
+
+// Dequeue the next driver buffer into the ring slot, in the storage format,
+// and give it back to the driver at once. Corrupt MJPG buffers are skipped.
+// captureTime is the kernel timestamp when it is on the monotonic clock.
+bool readV4L2 (unsigned int slot, double &captureTime)
+{
+	struct v4l2_buffer buffer;
+	cv::Mat &frame = frameArray[slot];
+
+	while (true)
+	{
+		memset (&buffer, 0, sizeof (buffer));
+		buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		buffer.memory = V4L2_MEMORY_MMAP;
+		if (xioctl (v4l2Device, VIDIOC_DQBUF, &buffer) == -1) { std::cout << "-> V4L2 CAPTURE FAILED" << std::endl; return false; }
+		if (v4l2Format != V4L2_PIX_FMT_MJPEG) { break; }
+
+		cv::Mat encoded (1, buffer.bytesused, CV_8UC1, v4l2Buffers[buffer.index].start);
+		if (decodeJPEG (encoded, storageFormat == BGR && ! scaledIngest ? frame : capturedFrame)) { break; }
+
+		if (xioctl (v4l2Device, VIDIOC_QBUF, &buffer) == -1) { std::cout << "-> V4L2 CAPTURE FAILED" << std::endl; return false; }
+	}
+
+	uchar *data = (uchar *) v4l2Buffers[buffer.index].start;
+	if (frame.empty()) { frame = newFrame (frameWidth, frameHeight); }
+
+	if (v4l2Format == V4L2_PIX_FMT_MJPEG) {
+		if (storageFormat != BGR || scaledIngest) { ingestFrame (capturedFrame, frame, scaledFrame); }
+	}
+
+	// Scaled frames go through BGR
+	else if (scaledIngest) {
+		if (v4l2Format == V4L2_PIX_FMT_YUYV) { cv::cvtColor (cv::Mat (captureHeight, captureWidth, CV_8UC2, data, v4l2Stride), capturedFrame, cv::COLOR_YUV2BGR_YUYV); }
+		else { cv::cvtColor (cv::Mat (captureHeight * 3 / 2, captureWidth, CV_8UC1, data), capturedFrame, cv::COLOR_YUV2BGR_I420); }
+		ingestFrame (capturedFrame, frame, scaledFrame);
+	}
+
+	// Luma is taken as is, and RGB565 goes through BGR
+	else if (v4l2Format == V4L2_PIX_FMT_YUYV) {
+		cv::Mat yuyv (frameHeight, frameWidth, CV_8UC2, data, v4l2Stride);
+		if (storageFormat == YUV420) { yuyvToI420 (data, frame); }
+		else if (storageFormat == GRAY) { cv::cvtColor (yuyv, frame, cv::COLOR_YUV2GRAY_YUYV); }
+		else if (storageFormat == BGR) { cv::cvtColor (yuyv, frame, cv::COLOR_YUV2BGR_YUYV); }
+		else { cv::cvtColor (yuyv, capturedFrame, cv::COLOR_YUV2BGR_YUYV); storeBGR (capturedFrame, frame); }
+	}
+
+	else {
+		cv::Mat i420 (frameHeight * 3 / 2, frameWidth, CV_8UC1, data);
+		if (storageFormat == YUV420) { i420.copyTo (frame); }
+		else if (storageFormat == GRAY) { i420.rowRange (0, frameHeight).copyTo (frame); }
+		else if (storageFormat == BGR) { cv::cvtColor (i420, frame, cv::COLOR_YUV2BGR_I420); }
+		else { cv::cvtColor (i420, capturedFrame, cv::COLOR_YUV2BGR_I420); storeBGR (capturedFrame, frame); }
+	}
+
+	if ((buffer.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC) { captureTime = buffer.timestamp.tv_sec + buffer.timestamp.tv_usec / 1e6; }
+
+	if (xioctl (v4l2Device, VIDIOC_QBUF, &buffer) == -1) { std::cout << "-> V4L2 CAPTURE FAILED" << std::endl; return false; }
+	return true;
+}
+
+
+// Copy the next compressed frame out of its driver buffer, which goes back
+// to the driver at once
+bool grabV4L2 (std::vector<uchar> &data, double &captureTime)
+{
+	struct v4l2_buffer buffer;
+	memset (&buffer, 0, sizeof (buffer));
+	buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	buffer.memory = V4L2_MEMORY_MMAP;
+	if (xioctl (v4l2Device, VIDIOC_DQBUF, &buffer) == -1) { std::cout << "-> V4L2 CAPTURE FAILED" << std::endl; return false; }
+
+	const uchar *start = (const uchar *) v4l2Buffers[buffer.index].start;
+	data.assign (start, start + buffer.bytesused);
+	captureTime = monotonicTime();
+	if ((buffer.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC) { captureTime = buffer.timestamp.tv_sec + buffer.timestamp.tv_usec / 1e6; }
+
+	if (xioctl (v4l2Device, VIDIOC_QBUF, &buffer) == -1) { std::cout << "-> V4L2 CAPTURE FAILED" << std::endl; return false; }
+	return true;
+}
+
+
+void startDecoders ()
+{
+	std::cout << "MJPG decoders: " << decodeThreads << std::endl;
+	decodeJobs = new DecodeJob [decodeThreads];
+	decodeQueue = new BoundedQueue<DecodeJob *> (decodeThreads);
+	decodeWorkers = new pthread_t [decodeThreads];
+	for (unsigned int i = 0; i < decodeThreads; i++)
+	{
+		if (storageFormat != BGR || scaledIngest) { decodeJobs[i].decoded = arenaMat (captureHeight, captureWidth, CV_8UC3); }
+		if (storageFormat != BGR && scaledIngest) { decodeJobs[i].scaled = arenaMat (frameHeight, frameWidth, CV_8UC3); }
+	}
+
+	for (unsigned int i = 0; i < decodeThreads; i++)
+	{
+		int t = pthread_create (&decodeWorkers[i], NULL, decodeLoop, NULL);
+		if (t) { std::cout << "Error: unable to create thread " << t << std::endl; exit(-1); }
+	}
+}
+
+
+void stopDecoders ()
+{
+	decodeQueue->close();
+	for (unsigned int i = 0; i < decodeThreads; i++)
+	{
+		int t = pthread_join (decodeWorkers[i], NULL);
+		if (t) { std::cout << "Error: unable to join " << t << std::endl; exit(-1); }
+	}
+}
+
+
+void *decodeLoop (void *arg)
+{
+	DecodeJob *job;
+
+	while (decodeQueue->pop (job))
+	{
+		cv::Mat &frame = frameArray[job->slot];
+		cv::Mat &decoded = storageFormat == BGR && ! scaledIngest ? frame : job->decoded;
+		bool ok = decodeJPEG (cv::Mat (1, job->data.size(), CV_8UC1, job->data.data()), decoded);
+		if (ok && (storageFormat != BGR || scaledIngest)) { ingestFrame (decoded, frame, job->scaled); }
+
+		pthread_mutex_lock (&decodeMutex);
+		job->ok = ok;
+		job->done = true;
+		pthread_cond_broadcast (&decodeDone);
+		pthread_mutex_unlock (&decodeMutex);
+	}
+
+	return NULL;
+}
+
+
+// Pooled capture into slot: keep decodeThreads frames in flight, in slot and
+// the slots after it, and return once the frame of slot is decoded. A frame
+// that fails to decode repeats the previous one.
+bool decodeFrame (unsigned int slot, double &captureTime)
+{
+	static unsigned long requested = 0, returned = 0;
+
+	while (requested < returned + decodeThreads)
+	{
+		DecodeJob &job = decodeJobs[requested % decodeThreads];
+		if (! grabV4L2 (job.data, job.time)) {
+			if (requested == returned) { return false; }
+			break;
+		}
+
+		job.slot = (slot + (requested - returned)) % ringSize;
+		job.done = false;
+		if (ringBase) { recycleSlot (job.slot); }
+		decodeQueue->push (&job);
+		requested++;
+	}
+
+	DecodeJob &job = decodeJobs[returned % decodeThreads];
+	pthread_mutex_lock (&decodeMutex);
+	while (! job.done) { pthread_cond_wait (&decodeDone, &decodeMutex); }
+	pthread_mutex_unlock (&decodeMutex);
+	returned++;
+
+	if (! job.ok) { frameArray[(slot + ringSize - 1) % ringSize].copyTo (frameArray[slot]); }
+	captureTime = job.time;
+	return true;
+}
+
+
+// Decode a JPEG camera frame into frame, a ring slot or scratch frame that
+// keeps its memory whatever happens: OpenCV releases or reallocates the
+// matrix it decodes into when a frame is corrupt or of another size, so it
+// is given a copy of the header. Returns whether frame was filled.
+bool decodeJPEG (const cv::Mat &encoded, cv::Mat &frame)
+{
+	cv::Mat decoded = frame;
+	cv::imdecode (encoded, cv::IMREAD_COLOR, &decoded);
+	if (decoded.cols != (int) captureWidth || decoded.rows != (int) captureHeight) { return false; }
+	if (decoded.data != frame.data) { decoded.copyTo (frame); }
+	return true;
+}
+
+
+void closeV4L2 ()
+{
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	xioctl (v4l2Device, VIDIOC_STREAMOFF, &type);
+	for (unsigned int i = 0; i < v4l2Buffers.size(); i++) { munmap (v4l2Buffers[i].start, v4l2Buffers[i].length); }
+	v4l2Buffers.clear();
+	close (v4l2Device);
+	v4l2Device = -1;
+}
+
+
+// Repack packed 4:2:2 YUYV into the planar I420 ring layout, averaging the
+// chroma of each pair of rows
+void yuyvToI420 (const uchar *yuyv, cv::Mat &frame)
+{
+	uchar *y = frame.data + planes[0].offset;
+	uchar *u = frame.data + planes[1].offset;
+	uchar *v = frame.data + planes[2].offset;
+
+	for (unsigned int r = 0; r < frameHeight; r += 2)
+	{
+		const uchar *top = yuyv + r * v4l2Stride, *bottom = top + v4l2Stride;
+		uchar *yTop = y + r * planes[0].step, *yBottom = yTop + planes[0].step;
+		uchar *uRow = u + (r / 2) * planes[1].step, *vRow = v + (r / 2) * planes[2].step;
+
+		for (unsigned int c = 0; c < frameWidth / 2; c++)
+		{
+			yTop[2*c] = top[4*c]; yTop[2*c+1] = top[4*c+2];
+			yBottom[2*c] = bottom[4*c]; yBottom[2*c+1] = bottom[4*c+2];
+			uRow[c] = (top[4*c+1] + bottom[4*c+1] + 1) >> 1;
+			vRow[c] = (top[4*c+3] + bottom[4*c+3] + 1) >> 1;
+		}
+	}
+}
+
+
+// Ring slot of the oldest frame shown when the one in slot is the newest:
+// startDelay-1 frames behind it
+unsigned int oldestSlot (unsigned int slot, unsigned int startDelay)
+{
+	if (timedDelay) { return slotAt (slot, (startDelay - 1) / nominalFps); }
+	return slotBehind (slot, startDelay - 1);
+}
+
+
+// Ring slot of the frame age frames older than the one in slot, or of the
+// first frame captured while the ring is still filling
+unsigned int slotBehind (unsigned int slot, unsigned int age)
+{
+	return (slot + ringSize - std::min ((unsigned long) age, frameNumbers[slot])) % ringSize;
+}
+
+
+// Ring slot of the frame captured nearest to age seconds before the one in
+// slot, among the historySize frames kept behind it. Capture times grow with
+// frame numbers, hence the binary search on how far back to go.
+unsigned int slotAt (unsigned int slot, double age)
+{
+	const double target = frameTimes[slot] - age;
+	const unsigned long kept = std::min ((unsigned long) historySize, frameNumbers[slot] + 1);
+
+	unsigned long low = 0, high = kept - 1;
+	while (low < high)
+	{
+		unsigned long middle = (low + high) / 2;
+		if (frameTimes[(slot + ringSize - middle) % ringSize] <= target) { high = middle; } else { low = middle + 1; }
+	}
+
+	// low is the newest frame captured no later than target (or the oldest
+	// one kept), low-1 the next one
+	if (low > 0 && frameTimes[(slot + ringSize - low + 1) % ringSize] - target < target - frameTimes[(slot + ringSize - low) % ringSize]) { low--; }
+	return (slot + ringSize - low) % ringSize;
+}
+
+
+double monotonicTime ()
+{
+	struct timespec t;
+	clock_gettime (CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+
+// Account for one run of stage on captured frame number frame (for display
+// and later stages, the newest frame shown), started at start. Only ever
+// called by the thread running the stage.
+void stageDone (Stage stage, unsigned long frame, double start)
+{
+	double end = monotonicTime();
+	latencies[stage].add ((end - start) * 1e6);
+	if (traceFile) { TraceEvent event = { frame, start, end }; traceRings[stage].push (event); }
+	stageFrames[stage]++;
+}
+
+
+// Latency percentiles of each stage over the last period
+void printLatencies ()
+{
+	std::cout << "LATENCY (p50/p95/p99 ms):";
+	for (unsigned int s = 0; s < STAGES; s++)
+	{
+		double p [3];
+		if (latencies[s].summary (p, true) == 0) { continue; }
+		printf (" %s %.2f/%.2f/%.2f", stageNames[s], p[0], p[1], p[2]);
+	}
+	std::cout << std::endl;
+}
+
+
+void *traceLoop (void *arg)
+{
+	const bool chrome = traceFileName.size() > 5 && traceFileName.compare (traceFileName.size() - 5, 5, ".json") == 0;
+	bool first = true;
+
+	if (chrome) { fprintf (traceFile, "["); }
+	else { fprintf (traceFile, "stage,frame,start_ms,duration_ms\n"); }
+
+	while (true)
+	{
+		bool done = traceDone;
+		TraceEvent event;
+
+		for (unsigned int s = 0; s < STAGES; s++)
+			while (traceRings[s].pop (event))
+			{
+				double start = (event.start - originTime) * 1000, duration = (event.end - event.start) * 1000;
+				if (chrome) {
+					fprintf (traceFile, "%s\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %u, \"ts\": %.1f, \"dur\": %.1f, \"args\": {\"frame\": %lu}}",
+						first ? "" : ",", stageNames[s], s, start * 1000, duration * 1000, event.frame);
+				}
+				else { fprintf (traceFile, "%s,%lu,%.3f,%.3f\n", stageNames[s], event.frame, start, duration); }
+				first = false;
+			}
+
+		if (done) { break; }
+		usleep (100000);
+	}
+
+	if (chrome) { fprintf (traceFile, "\n]\n"); }
+	fclose (traceFile);
+
+	unsigned long dropped = 0;
+	for (unsigned int s = 0; s < STAGES; s++) { dropped += traceRings[s].dropped; }
+	if (dropped > 0) { std::cout << "TRACE: " << dropped << " events dropped" << std::endl; }
+	return NULL;
+}
+
+
+// Benchmark source: a gradient scrolling by one row per frame, written
+// straight into the ring in the storage format, as fast as possible. With
+// ingest scaling, it is drawn at capture size and scaled like camera frames.
+void syntheticFrame (cv::Mat &frame)
+{
+	static unsigned int frameNb = 0;
+	if (frame.empty()) { frame = newFrame (frameWidth, frameHeight); }
+
+	if (scaledIngest) {
+		for (int r = 0; r < capturedFrame.rows; r++) { memset (capturedFrame.ptr (r), (r + frameNb) & 0xFF, capturedFrame.cols * 3); }
+		ingestFrame (capturedFrame, frame, scaledFrame);
+	}
+
+	else for (unsigned int p = 0; p < planes.size(); p++)
+	{
+		const Plane &plane = planes[p];
+		const unsigned int round = (1 << plane.shift) - 1;
+		const unsigned int rows = (frameHeight + round) >> plane.shift;
+		const size_t rowBytes = ((frameWidth + round) >> plane.shift) * plane.pixelSize;
+		for (unsigned int r = 0; r < rows; r++) { memset (frame.data + plane.offset + r * plane.step, (r + frameNb) & 0xFF, rowBytes); }
+	}
+
+	frameNb++;
+}
+
+
+// One JSON line: the configuration, the throughput, and the time spent by
+// each stage per frame in milliseconds
+void printBenchmark (double seconds)
+{
+	const unsigned int frames = stageFrames[POSTPROCESS];
+	const View &view = outputs[0]->view;
+	printf ("{\"width\": %u, \"height\": %u, \"maxDelay\": %u, \"vertical\": %s, \"reverse\": %s, \"symmetric\": %s, ",
+		frameWidth, frameHeight, maxDelay, view.vertical ? "true" : "false", view.reverse ? "true" : "false", view.symmetric ? "true" : "false");
+	printf ("\"storage\": \"%s\", \"bandRetention\": %s, \"threads\": %u, \"source\": \"%s\", \"frames\": %u, \"seconds\": %.3f, \"fps\": %.1f",
+		storageNames[storageFormat], bandRetention ? "true" : "false", composeThreads, fromFile ? "file" : "synthetic", frames, seconds, frames / seconds);
+	for (unsigned int s = 0; s < STAGES; s++) {
+		double p [3];
+		if (latencies[s].summary (p, false) == 0) { continue; }
+		printf (", \"%s\": {\"p50\": %.3f, \"p95\": %.3f, \"p99\": %.3f}", stageNames[s], p[0], p[1], p[2]);
+	}
+	printf ("}\n");
+	fflush (stdout);
+}
+
+
+
+
+
+// Map the ring onto ringFileName, one page-aligned slot per frame. The file is
+// unlinked at once, so that it goes away with the program.
+void openRingFile ()
+{
+	cv::Mat frame = newFrame (frameWidth, frameHeight);
+	const size_t pageSize = sysconf (_SC_PAGESIZE);
+	ringSlotBytes = (frame.total() * frame.elemSize() + pageSize - 1) / pageSize * pageSize;
+	const size_t ringBytes = (size_t) ringSize * ringSlotBytes;
+
+	std::cout << "OPENING RING FILE " << ringFileName << std::endl;
+	ringFile = open (ringFileName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (ringFile == -1) { std::cout << "-> FILE NOT FOUND" << std::endl; exit(-1); }
+	unlink (ringFileName.c_str());
+
+	if (ftruncate (ringFile, ringBytes) == -1) { std::cout << "-> RING FILE TOO LARGE" << std::endl; exit(-1); }
+	void *base = mmap (NULL, ringBytes, PROT_READ | PROT_WRITE, MAP_SHARED, ringFile, 0);
+	if (base == MAP_FAILED) { std::cout << "-> RING FILE CANNOT BE MAPPED" << std::endl; exit(-1); }
+	ringBase = (uchar *) base;
+
+	for (unsigned int i = 0; i < ringSize; i++) { frameArray[i] = cv::Mat (frame.rows, frame.cols, frame.type(), ringBase + (size_t) i * ringSlotBytes); }
+
+	if (fallocate (ringFile, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, ringSlotBytes) == -1) {
+		std::cout << "-> RING FILE CANNOT PUNCH HOLES, OLD FRAMES ARE READ BACK BEFORE BEING OVERWRITTEN" << std::endl;
+		ringPunch = false;
+	}
+}
+
+
+// Disk-backed ring: drop the old frame of slot before a new one is written
+// there. Otherwise, the first write to each page of the mapping would read
+// the old frame back from disk.
+void recycleSlot (unsigned int slot)
+{
+	if (ringPunch) { fallocate (ringFile, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t) slot * ringSlotBytes, ringSlotBytes); }
+}
+
+
+// Planes of a width x height frame in the storage format
+std::vector<Plane> framePlanes (unsigned int width, unsigned int height)
+{
+	std::vector<Plane> planes;
+	switch (storageFormat)
+	{
+	case BGR :
+		{
+			Plane bgr = { 0, width * 3, 3, 0 };
+			planes.push_back (bgr);
+		}
+		break;
+
+	case YUV420 :
+		{
+			Plane y = { 0, width, 1, 0 };
+			Plane u = { width * height, width / 2, 1, 1 };
+			Plane v = { width * height * 5/4, width / 2, 1, 1 };
+			planes.push_back (y);
+			planes.push_back (u);
+			planes.push_back (v);
+		}
+		break;
+
+	case GRAY :
+		{
+			Plane y = { 0, width, 1, 0 };
+			planes.push_back (y);
+		}
+		break;
+
+	case RGB565 :
+		{
+			Plane rgb = { 0, width * 2, 2, 0 };
+			planes.push_back (rgb);
+		}
+		break;
+	}
+	return planes;
+}
+
+
+// Allocate a width x height frame in the storage format, from the arena if
+// it has room left. Like ring slots filled by the camera, it is continuous, as
+// compositeLayout expects.
+cv::Mat newFrame (unsigned int width, unsigned int height)
+{
+	switch (storageFormat)
+	{
+	case YUV420 : return arenaMat (height * 3/2, width, CV_8UC1);
+	case GRAY : return arenaMat (height, width, CV_8UC1);
+	case RGB565 : return arenaMat (height, width, CV_8UC2);
+	default : return arenaMat (height, width, CV_8UC3);
+	}
+}
+
+
+// Map an arena of size bytes and prefault it, but for its first lazy bytes
+// (the ring), which a background thread populates while the first frames
+// come in. Transparent huge pages only back aligned huge pages, hence the
+// alignment, and must be asked for before the memory is touched.
+void openArena (size_t size, size_t lazy)
+{
+	const size_t hugePageSize = 2 << 20;
+	const char *backing = "no huge pages";
+	void *base = MAP_FAILED;
+
+	if (hugePages == HUGETLB_PAGES) {
+		size = (size + hugePageSize - 1) / hugePageSize * hugePageSize;
+		base = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (base == MAP_FAILED) { std::cout << "-> NOT ENOUGH HUGE PAGES RESERVED, USING TRANSPARENT HUGE PAGES" << std::endl; }
+		else { backing = "huge pages"; }
+	}
+
+	if (base == MAP_FAILED && hugePages != NO_HUGE_PAGES) {
+		void *block = mmap (NULL, size + hugePageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (block != MAP_FAILED) {
+			base = (void *) (((uintptr_t) block + hugePageSize - 1) & ~(uintptr_t) (hugePageSize - 1));
+			madvise (base, size, MADV_HUGEPAGE);
+			backing = "transparent huge pages";
+		}
+	}
+
+	if (base == MAP_FAILED) { base = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0); }
+	if (base == MAP_FAILED) { std::cout << "-> NOT ENOUGH MEMORY FOR THE ARENA" << std::endl; exit(-1); }
+
+	arenaBase = (uchar *) base;
+	arenaSize = size;
+	lazy = std::min (lazy, size);
+	memset (arenaBase + lazy, 0, size - lazy);
+	std::cout << "arena: " << (size >> 20) << " MB (" << backing << ")" << std::endl;
+
+	if (lazy == 0) { return; }
+	pthread_t warmThread;
+	int t = pthread_create (&warmThread, NULL, warmLoop, (void *) lazy);
+	if (t) { std::cout << "Error: unable to create thread " << t << std::endl; exit(-1); }
+	pthread_detach (warmThread);
+}
+
+
+// Populate the first bytes of the arena, in the order capture fills the ring,
+// without writing to them: capture may already be storing frames there. On
+// kernels without MADV_POPULATE_WRITE, pages are faulted in by capture.
+void *warmLoop (void *arg)
+{
+	const size_t bytes = (size_t) arg;
+	const size_t chunk = 2 << 20;
+	for (size_t offset = 0; offset < bytes; offset += chunk)
+	{
+		if (madvise (arenaBase + offset, std::min (chunk, bytes - offset), MADV_POPULATE_WRITE) != 0) { break; }
+	}
+
+	return NULL;
+}
+
+
+// Bytes a rows x cols matrix takes in the arena: frames start on pages
+size_t arenaBytes (int rows, int cols, int type)
+{
+	const size_t pageSize = sysconf (_SC_PAGESIZE);
+	return ((size_t) rows * cols * CV_ELEM_SIZE (type) + pageSize - 1) / pageSize * pageSize;
+}
+
+
+cv::Mat arenaMat (int rows, int cols, int type)
+{
+	const size_t bytes = arenaBytes (rows, cols, type);
+	if (arenaUsed + bytes > arenaSize) { return cv::Mat (rows, cols, type); }
+
+	cv::Mat mat (rows, cols, type, arenaBase + arenaUsed);
+	arenaUsed += bytes;
+	return mat;
+}
+
+
+cv::Mat newBlackFrame ()
+{
+	cv::Mat frame = newFrame (frameWidth, frameHeight);
+	switch (storageFormat)
+	{
+	case YUV420 :
+		frame.rowRange (0, frameHeight).setTo (cv::Scalar (0));
+		frame.rowRange (frameHeight, frameHeight * 3/2).setTo (cv::Scalar (128));
+		break;
+
+	default :
+		frame.setTo (cv::Scalar (0, 0, 0));
+	}
+	return frame;
+}
+
+
+// Copy the pixels of rect, in frame coordinates, from src, which stores the
+// pixels of srcBox, to dst, which stores the pixels of dstBox
+void copyBox (cv::Mat &dst, const std::vector<Plane> &dstPlanes, const cv::Rect &dstBox, const cv::Mat &src, const std::vector<Plane> &srcPlanes, const cv::Rect &srcBox, const cv::Rect &rect)
+{
+	for (unsigned int p = 0; p < dstPlanes.size(); p++)
+	{
+		const unsigned int shift = dstPlanes[p].shift;
+		const size_t bytes = (rect.width >> shift) * dstPlanes[p].pixelSize;
+
+		for (int r = rect.y >> shift; r < (rect.y + rect.height) >> shift; r++)
+		{
+			uchar *currentPixel = dst.data + dstPlanes[p].offset + (r - (dstBox.y >> shift)) * dstPlanes[p].step + ((rect.x - dstBox.x) >> shift) * dstPlanes[p].pixelSize;
+			const uchar *workingPixel = src.data + srcPlanes[p].offset + (r - (srcBox.y >> shift)) * srcPlanes[p].step + ((rect.x - srcBox.x) >> shift) * srcPlanes[p].pixelSize;
+			memcpy (currentPixel, workingPixel, bytes);
+		}
+	}
+}
+
+
+// Rebuild the delay map and the layout of output when the settings of its
+// view that they depend on change. The generators work on globals, so
+// outputs take turns.
+void updateLayout (Output &output)
+{
+	const View &view = output.view, &built = output.layoutView;
+	if (output.layoutValid && built.delay == view.delay && built.startDelay == view.startDelay && built.heterogeneousDelay == view.heterogeneousDelay
+		&& built.vertical == view.vertical && built.reverse == view.reverse && built.symmetric == view.symmetric && built.pattern == view.pattern) { return; }
+
+	output.layoutView = view;
+	output.layoutValid = true;
+
+	pthread_mutex_lock (&layoutMutex);
+	delay = view.delay;
+	heterogeneousDelay = view.heterogeneousDelay;
+	vertical = view.vertical;
+	reverse = view.reverse;
+	symmetric = view.symmetric;
+	pattern = view.pattern;
+
+	workingDelay = 0;
+	addBand (0, frameHeight, 0, frameWidth);
+
+	if (heterogeneousDelay) switch (pattern)
+	{
+	case LINEAR :
+		if (vertical) {
+			if (reverse) {
+				if (symmetric) { computeVerticalReverseSymmetric(); }
+				else { computeVerticalReverse(); }
+			} else {
+				if (symmetric) { computeVerticalSymmetric(); }
+				else { computeVertical(); }
+			}
+		} else {
+			if (reverse) {
+				if (symmetric) { computeHorizontalReverseSymmetric(); }
+				else { computeHorizontalReverse(); }
+			} else {
+				if (symmetric) { computeHorizontalSymmetric(); }
+				else { computeHorizontal(); }
+			}
+		}
+		break;
+
+	case RADIAL : computeProfile (radialProfile); break;
+	case DIAGONAL : computeProfile (diagonalProfile); break;
+	case IMAGE : if (! mapImage.empty()) { computeProfile (imageProfile); } break;
+	}
+
+	compileDelayMap();
+	if (bandRetention) { buildLevels (view.startDelay); }
+	output.layout = layout;
+	pthread_mutex_unlock (&layoutMutex);
+}
+
+
+// Compile the delay map into strips and spans: each row becomes the runs of
+// equal delay along it, and consecutive rows with the same runs share a strip
+void compileDelayMap ()
+{
+	layout.clear();
+	for (unsigned int r = 0; r < frameHeight; r++)
+	{
+		const unsigned short *offset = delayMap.ptr<unsigned short>(r);
+
+		Strip strip;
+		strip.firstRow = r;
+		strip.lastRow = r+1;
+
+		for (unsigned int c = 0; c < frameWidth; c++)
+		{
+			if (! strip.spans.empty() && strip.spans.back().offset == offset[c]) { strip.spans.back().lastCol = c+1; }
+			else { Span span = { c, c+1, offset[c], offset[c] }; strip.spans.push_back (span); }
+		}
+
+		if (! layout.empty() && layout.back().spans.size() == strip.spans.size()
+			&& std::equal (strip.spans.begin(), strip.spans.end(), layout.back().spans.begin(), sameSpan))
+			layout.back().lastRow = strip.lastRow;
+		else layout.push_back (strip);
+	}
+}
+
+
+// Point sources at the frames a layout of startDelay frames reads, for each
+// plane, when slot is the newest one
+void setSources (unsigned int slot, unsigned int startDelay, std::vector<Source> &sources)
+{
+	if (! bandRetention)
+	{
+		sources.resize (startDelay * planes.size());
+		for (unsigned int offset = 0; offset < startDelay; offset++)
+		{
+			unsigned int frameSlot = slotBehind (slot, startDelay - 1 - offset);
+			if (timedDelay) { frameSlot = slotAt (slot, (startDelay - 1 - offset) / nominalFps); }
+
+			const cv::Mat &frame = frameArray[frameSlot];
+			for (unsigned int p = 0; p < planes.size(); p++)
 			{
-				currentPixel[i][0] = workingPixel[i][0];
-				currentPixel[i][1] = workingPixel[i][1];
-				currentPixel[i][2] = workingPixel[i][2];
-				i += frameWidth;
+				Source source = { frame.data + planes[p].offset, planes[p].step, 0, 0 };
+				sources[offset * planes.size() + p] = source;
 			}
+		}
+		return;
+	}
+
+	sources.resize (retained.size() * planes.size());
+	for (unsigned int k = 0; k < retained.size(); k++)
+	{
+		const Level &level = levels[retained[k].level];
+		const cv::Mat &slice = level.slices[sliceOf ((long) retainedNb - 1 - retained[k].age, level.age)];
+		for (unsigned int p = 0; p < planes.size(); p++)
+		{
+			Source source = { slice.data + level.planes[p].offset, level.planes[p].step, (unsigned int) level.box.y >> planes[p].shift, (unsigned int) level.box.x >> planes[p].shift };
+			sources[k * planes.size() + p] = source;
+		}
+	}
+}
+
+
+// Disk-backed ring: ask the kernel to start reading what compositing will
+// read ringReadAhead frames from now, that is, for each source, the bytes the
+// layout of output reads from it, ringReadAhead slots later. Sources that are
+// not captured yet are skipped.
+void prefetchSources (const Output &output, unsigned int slot)
+{
+	const std::vector<Strip> &layout = output.layout;
+	const unsigned int startDelay = output.view.startDelay;
+	const size_t sourceNb = startDelay * planes.size();
+	std::vector<size_t> first (sourceNb, ringSlotBytes), last (sourceNb, 0);
 
-			i = (frameWidth-1) - c;
-			for (unsigned int r = 0; r < frameHeight; r++)
+	for (unsigned int s = 0; s < layout.size(); s++)
+	{
+		const Strip &strip = layout[s];
+		for (unsigned int k = 0; k < strip.spans.size(); k++)
+		{
+			const Span &span = strip.spans[k];
+			for (unsigned int p = 0; p < planes.size(); p++)
 			{
-				currentPixel[i][0] = workingPixel[i][0];
-				currentPixel[i][1] = workingPixel[i][1];
-				currentPixel[i][2] = workingPixel[i][2];
-				i += frameWidth;
+				const Plane &plane = planes[p];
+				const size_t begin = plane.offset + (strip.firstRow >> plane.shift) * plane.step + (span.firstCol >> plane.shift) * plane.pixelSize;
+				const size_t end = plane.offset + ((strip.lastRow - 1) >> plane.shift) * plane.step + (((span.lastCol - 1) >> plane.shift) + 1) * plane.pixelSize;
+				const size_t i = span.offset * planes.size() + p;
+				first[i] = std::min (first[i], begin);
+				last[i] = std::max (last[i], end);
 			}
+		}
+	}
 
+	const size_t pageSize = sysconf (_SC_PAGESIZE);
+	for (unsigned int offset = 0; offset < startDelay; offset++)
+	{
+		unsigned int frameSlot = slotBehind (slot, startDelay - 1 - offset);
+		if (timedDelay) { frameSlot = slotAt (slot, (startDelay - 1 - offset) / nominalFps); }
+		if ((slot + ringSize - frameSlot) % ringSize < ringReadAhead) { continue; }
+
+		uchar *frame = ringBase + (size_t) ((frameSlot + ringReadAhead) % ringSize) * ringSlotBytes;
+		for (unsigned int p = 0; p < planes.size(); p++)
+		{
+			const size_t i = offset * planes.size() + p;
+			if (first[i] >= last[i]) { continue; }
+			const size_t begin = first[i] / pageSize * pageSize;
+			madvise (frame + begin, last[i] - begin, MADV_WILLNEED);
 		}
-		firstCol = lastCol;
 	}
+}
+
 
-	if (parallelComputation) { pthread_exit (NULL); }
+// Gather layout into frame, plane by plane. Strips made of one
+// full-width span are one contiguous block of their source when it stores
+// whole rows, and are copied at once; the others are walked row by row,
+// copying from each source the short contiguous span of the row that belongs
+// to it. The copies are left to memcpy, which already picks the widest SIMD
+// variant of the running CPU. Subsampled planes take each pixel from the
+// layout at its top left pixel.
+void compositeLayout (cv::Mat &frame, const std::vector<Strip> &layout, const std::vector<Source> &sources)
+{
+	if (composeThreads <= 1) { compositeRows (frame, layout, sources, 0, frameHeight); return; }
+
+	pthread_mutex_lock (&poolMutex);
+	pthread_mutex_lock (&workMutex);
+	workFrame = &frame;
+	workLayout = &layout;
+	workSources = &sources;
+	workPending = composeThreads - 1;
+	workGeneration++;
+	pthread_cond_broadcast (&workStart);
+	pthread_mutex_unlock (&workMutex);
+
+	compositeRows (frame, layout, sources, 0, (frameHeight / composeThreads) & ~1);
+
+	pthread_mutex_lock (&workMutex);
+	while (workPending > 0) { pthread_cond_wait (&workDone, &workMutex); }
+	pthread_mutex_unlock (&workMutex);
+	pthread_mutex_unlock (&poolMutex);
 }
 
 
-void *computeVerticalReverse (void *arg)
+// Composite the rows [stripeFirstRow, stripeLastRow) of frame
+void compositeRows (cv::Mat &frame, const std::vector<Strip> &layout, const std::vector<Source> &sources, unsigned int stripeFirstRow, unsigned int stripeLastRow)
 {
-	workingDelay = currentDelay;
-	float firstCol = (delay-1) * ((float) frameWidth / (float) delay);
-	
-	for (unsigned int d = 1; d < delay; d++)
+	for (unsigned int p = 0; p < planes.size(); p++)
 	{
-		workingDelay++;
-		if (workingDelay >= maxDelay+2) { workingDelay = 0; }
-		workingPixel = frameArray[workingDelay].ptr<cv::Vec3b>(0);
-
-		float lastCol = (delay-(d+1)) * ((float) frameWidth / (float) delay);
+		const Plane &plane = planes[p];
+		const unsigned int round = (1 << plane.shift) - 1;
+		uchar *currentPlane = frame.data + plane.offset;
 
-		for (unsigned int c = (unsigned int) firstCol; c > (unsigned int) lastCol; c--)
+		for (std::vector<Strip>::const_iterator strip = layout.begin(); strip != layout.end(); ++strip)
 		{
-			unsigned int i = c;
-			for (unsigned int r = 0; r < frameHeight; r++)
+			if (strip->lastRow <= stripeFirstRow || strip->firstRow >= stripeLastRow) { continue; }
+
+			unsigned int firstRow = (std::max (strip->firstRow, stripeFirstRow) + round) >> plane.shift;
+			unsigned int lastRow = (std::min (strip->lastRow, stripeLastRow) + round) >> plane.shift;
+			if (firstRow >= lastRow) { continue; }
+
+			const Source *source = &sources[strip->spans[0].source * planes.size() + p];
+			if (strip->spans.size() == 1 && source->step == plane.step && source->firstCol == 0)
+			{
+				memcpy (currentPlane + firstRow * plane.step, source->data + (firstRow - source->firstRow) * source->step, (lastRow - firstRow) * plane.step);
+				continue;
+			}
+
+			for (unsigned int r = firstRow; r < lastRow; r++)
 			{
-				currentPixel[i][0] = workingPixel[i][0];
-				currentPixel[i][1] = workingPixel[i][1];
-				currentPixel[i][2] = workingPixel[i][2];
-				i += frameWidth;
+				uchar *currentPixel = currentPlane + r * plane.step;
+				for (std::vector<Span>::const_iterator span = strip->spans.begin(); span != strip->spans.end(); ++span)
+				{
+					unsigned int firstCol = (span->firstCol + round) >> plane.shift;
+					unsigned int lastCol = (span->lastCol + round) >> plane.shift;
+					if (firstCol >= lastCol) { continue; }
+
+					source = &sources[span->source * planes.size() + p];
+					const uchar *workingPixel = source->data + (r - source->firstRow) * source->step + (firstCol - source->firstCol) * plane.pixelSize;
+					memcpy (currentPixel + firstCol * plane.pixelSize, workingPixel, (lastCol - firstCol) * plane.pixelSize);
+				}
 			}
 		}
-		firstCol = lastCol;
 	}
+}
+
+
+
 
-	if (parallelComputation) { pthread_exit (NULL); }
+// Start the compositing workers, each one pinned to its own core. Stripe
+// bounds are even so that subsampled planes split at the same rows.
+void startComposeWorkers ()
+{
+	long cores = sysconf (_SC_NPROCESSORS_ONLN);
+	if (cores < 1) { cores = 1; }
+	if (composeThreads == 0) { composeThreads = cores; }
+	if (composeThreads > frameHeight / 2) { composeThreads = frameHeight / 2; }
+	std::cout << "compositing threads: " << composeThreads << std::endl;
+
+	composeWorkers = new pthread_t [composeThreads];
+	for (unsigned long i = 1; i < composeThreads; i++)
+	{
+		int t = pthread_create (&composeWorkers[i], NULL, composeWorker, (void *) i);
+		if (t) { std::cout << "Error: unable to create thread " << t << std::endl; exit(-1); }
+
+		cpu_set_t cpus;
+		CPU_ZERO (&cpus);
+		CPU_SET (i % cores, &cpus);
+		pthread_setaffinity_np (composeWorkers[i], sizeof (cpu_set_t), &cpus);
+	}
 }
 
 
-void *computeVerticalReverseSymmetric (void *arg)
+void *composeWorker (void *arg)
 {
-	workingDelay = currentDelay + delay/2;
-	if (workingDelay >= maxDelay+2) { workingDelay -= (maxDelay+2); }	
-	float firstCol = (delay-1) * ((float) frameWidth / (float) delay);
-	
-	for (unsigned int d = 1; d < delay/2; d++)
+	const unsigned long i = (unsigned long) arg;
+	const unsigned int firstRow = (frameHeight * i / composeThreads) & ~1;
+	const unsigned int lastRow = (i+1 == composeThreads) ? frameHeight : (frameHeight * (i+1) / composeThreads) & ~1;
+	unsigned long generation = 0;
+
+	while (true)
 	{
-		workingDelay++;
-		if (workingDelay >= maxDelay+2) { workingDelay = 0; }
-		workingPixel = frameArray[workingDelay].ptr<cv::Vec3b>(0);
+		pthread_mutex_lock (&workMutex);
+		while (workGeneration == generation) { pthread_cond_wait (&workStart, &workMutex); }
+		generation = workGeneration;
+		cv::Mat *frame = workFrame;
+		const std::vector<Strip> *layout = workLayout;
+		const std::vector<Source> *sources = workSources;
+		pthread_mutex_unlock (&workMutex);
+
+		compositeRows (*frame, *layout, *sources, firstRow, lastRow);
+
+		pthread_mutex_lock (&workMutex);
+		if (--workPending == 0) { pthread_cond_signal (&workDone); }
+		pthread_mutex_unlock (&workMutex);
+	}
 
-		float lastCol = (delay/2-(d+1)) * ((float) frameWidth / (float) delay);
+	return NULL;
+}
+
+
+
+
+// Store the box of each level of the frame in slot, then make sure the levels
+// match the current settings
+void retainFrame (unsigned int slot)
+{
+	const cv::Rect frameBox (0, 0, frameWidth, frameHeight);
+	for (std::vector<Level>::iterator level = levels.begin(); level != levels.end(); ++level)
+		copyBox (level->slices[sliceOf (retainedNb, level->age)], level->planes, level->box, frameArray[slot], planes, frameBox, level->box);
+
+	retainedNb++;
+	retainedSlot = slot;
+	updateLayout (*outputs[0]); // band retention has a single output
+}
+
+
+// Slice of a level of the given age holding frame number frame, which is
+// negative for the slices seeded before the first frame was retained
+unsigned int sliceOf (long frame, unsigned int age)
+{
+	long k = frame % (long) (age + 1);
+	return k < 0 ? k + age + 1 : k;
+}
+
+
+// Whether rects, all within box, cover the whole of it: each cell of the grid
+// their edges draw must be in one of them
+bool covers (const std::vector<cv::Rect> &rects, const cv::Rect &box)
+{
+	std::vector<int> xs (1, box.x), ys (1, box.y);
+	for (std::vector<cv::Rect>::const_iterator rect = rects.begin(); rect != rects.end(); ++rect)
+	{
+		xs.push_back (rect->x); xs.push_back (rect->x + rect->width);
+		ys.push_back (rect->y); ys.push_back (rect->y + rect->height);
+	}
+	xs.push_back (box.x + box.width); ys.push_back (box.y + box.height);
+	std::sort (xs.begin(), xs.end()); xs.erase (std::unique (xs.begin(), xs.end()), xs.end());
+	std::sort (ys.begin(), ys.end()); ys.erase (std::unique (ys.begin(), ys.end()), ys.end());
+
+	for (unsigned int i = 0; i + 1 < xs.size(); i++)
+		for (unsigned int k = 0; k + 1 < ys.size(); k++)
+		{
+			bool inside = false;
+			for (std::vector<cv::Rect>::const_iterator rect = rects.begin(); rect != rects.end() && ! inside; ++rect)
+				inside = rect->x <= xs[i] && xs[i+1] <= rect->x + rect->width && rect->y <= ys[k] && ys[k+1] <= rect->y + rect->height;
+			if (! inside) { return false; }
+		}
+	return true;
+}
+
+
+// Rebuild the levels for the current layout. The spans showing frames of a
+// given age are grouped into boxes, a span joining a box of its age as long as
+// that box stays at least 80% covered. If keeping the boxes costs as much as
+// keeping whole frames, a single whole-frame level is used instead.
+//
+// When the layout changes (delay, pattern or orientation), the new levels are
+// seeded from the old ones wherever the old levels still hold the frames they
+// need. Where no history is left, a slice repeats the next more recent one:
+// those regions start frozen on the oldest frame available and ramp up to the
+// new delay as frames come in. Levels whose box is unchanged, as most are
+// when the delay moves by one frame, keep their slices without any copy, and
+// each old level is released as soon as the new levels it seeds are done.
+// The rest is allocated and copied while compositing waits, so a change of
+// layout costs up to the memory of the full ring for a moment.
+void buildLevels (unsigned int startDelay)
+{
+	std::vector<Level> newLevels;
+	std::vector<double> covered;
+	std::vector<std::vector<unsigned int> > levelsOfAge (startDelay);
+	unsigned int maxAge = 0;
+
+	for (std::vector<Strip>::iterator strip = layout.begin(); strip != layout.end(); ++strip)
+	{
+		for (std::vector<Span>::iterator span = strip->spans.begin(); span != strip->spans.end(); ++span)
+		{
+			unsigned int age = startDelay - 1 - span->offset;
+			maxAge = std::max (maxAge, age);
+
+			// Subsampled planes need even boxes
+			cv::Rect rect (span->firstCol, strip->firstRow, span->lastCol - span->firstCol, strip->lastRow - strip->firstRow);
+			if (storageFormat == YUV420) {
+				rect.width += rect.x % 2; rect.x -= rect.x % 2; rect.width += rect.width % 2;
+				rect.height += rect.y % 2; rect.y -= rect.y % 2; rect.height += rect.height % 2;
+			}
+
+			int found = -1;
+			for (unsigned int k = 0; k < levelsOfAge[age].size() && found < 0; k++)
+			{
+				unsigned int l = levelsOfAge[age][k];
+				cv::Rect box = newLevels[l].box | rect;
+				if (box.area() * 0.8 > covered[l] + rect.area()) { continue; }
+
+				newLevels[l].box = box;
+				covered[l] += rect.area();
+				found = l;
+			}
+
+			if (found < 0)
+			{
+				Level level;
+				level.age = age;
+				level.box = rect;
+				found = newLevels.size();
+				newLevels.push_back (level);
+				covered.push_back (rect.area());
+				levelsOfAge[age].push_back (found);
+			}
+
+			span->source = found;
+		}
+	}
+
+	double retainedPixels = 0;
+	for (std::vector<Level>::const_iterator level = newLevels.begin(); level != newLevels.end(); ++level)
+		retainedPixels += (double) level->box.area() * (level->age + 1);
+
+	retained.clear();
+	if (retainedPixels < (double) frameWidth * frameHeight * (maxAge + 1))
+	{
+		for (unsigned int l = 0; l < newLevels.size(); l++)
+		{
+			Retained source = { l, newLevels[l].age };
+			retained.push_back (source);
+		}
+	}
+
+	else {
+		newLevels.resize (1);
+		newLevels[0].age = maxAge;
+		newLevels[0].box = cv::Rect (0, 0, frameWidth, frameHeight);
+
+		for (unsigned int age = 0; age <= maxAge; age++)
+		{
+			Retained source = { 0, age };
+			retained.push_back (source);
+		}
+
+		for (std::vector<Strip>::iterator strip = layout.begin(); strip != layout.end(); ++strip)
+			for (std::vector<Span>::iterator span = strip->spans.begin(); span != strip->spans.end(); ++span)
+				span->source = startDelay - 1 - span->offset;
+	}
+
+	const cv::Rect frameBox (0, 0, frameWidth, frameHeight);
+	const long n = retainedNb - 1;
+	size_t bytes = 0;
+
+	// An old level with the same box as a new one hands its slices over as
+	// they are. Otherwise old levels are kept until the last new level they
+	// seed is done, and then released, so that the old and new levels are
+	// not both held in full.
+	std::vector<int> match (newLevels.size(), -1);
+	std::vector<int> lastUse (levels.size(), -1);
+	std::vector<bool> matched (levels.size(), false);
+	for (unsigned int l = 0; l < newLevels.size(); l++)
+	{
+		for (unsigned int o = 0; o < levels.size(); o++)
+		{
+			if (match[l] < 0 && ! matched[o] && levels[o].box == newLevels[l].box) { match[l] = o; matched[o] = true; lastUse[o] = l; }
+			if (levels[o].age > 0 && newLevels[l].age > 0 && (levels[o].box & newLevels[l].box).area() > 0) { lastUse[o] = l; }
+		}
+	}
+
+	for (unsigned int o = 0; o < levels.size(); o++) { if (lastUse[o] < 0) { levels[o].slices.clear(); } }
 
-		for (unsigned int c = (unsigned int) firstCol; c > (unsigned int) lastCol; c--)
+	for (unsigned int l = 0; l < newLevels.size(); l++)
+	{
+		Level *level = &newLevels[l];
+		level->planes = framePlanes (level->box.width, level->box.height);
+		level->slices.resize (level->age + 1);
+
+		for (unsigned int j = 0; j <= level->age; j++)
 		{
-			unsigned int i = c;
-			for (unsigned int r = 0; r < frameHeight; r++)
+			cv::Mat &slice = level->slices[sliceOf (n - j, level->age)];
+			if (match[l] >= 0 && j <= levels[match[l]].age && (long) j <= n) {
+				const Level &old = levels[match[l]];
+				slice = old.slices[sliceOf (n - j, old.age)];
+				bytes += slice.total() * slice.elemSize();
+				continue;
+			}
+
+			slice = newFrame (level->box.width, level->box.height);
+			bytes += slice.total() * slice.elemSize();
+
+			if (j == 0) { copyBox (slice, level->planes, level->box, frameArray[retainedSlot], planes, frameBox, level->box); continue; }
+
+			// Ramp: repeat the next more recent frame, unless the old levels
+			// hold the whole box, then copy whatever history they hold
+			std::vector<cv::Rect> history;
+			for (std::vector<Level>::const_iterator old = levels.begin(); old != levels.end() && (long) j <= n; ++old)
 			{
-				currentPixel[i][0] = workingPixel[i][0];
-				currentPixel[i][1] = workingPixel[i][1];
-				currentPixel[i][2] = workingPixel[i][2];
-				i += frameWidth;
+				if (old->age < j || old->slices.empty()) { continue; }
+				cv::Rect rect = old->box & level->box;
+				if (rect.area() > 0) { history.push_back (rect); }
 			}
 
-			i = frameWidth - c;
-			for (unsigned int r = 0; r < frameHeight; r++)
+			if (! covers (history, level->box)) { level->slices[sliceOf (n - j + 1, level->age)].copyTo (slice); }
+
+			for (std::vector<Level>::const_iterator old = levels.begin(); old != levels.end() && (long) j <= n; ++old)
 			{
-				currentPixel[i][0] = workingPixel[i][0];
-				currentPixel[i][1] = workingPixel[i][1];
-				currentPixel[i][2] = workingPixel[i][2];
-				i += frameWidth;
+				if (old->age < j || old->slices.empty()) { continue; }
+				cv::Rect rect = old->box & level->box;
+				if (rect.area() == 0) { continue; }
+				copyBox (slice, level->planes, level->box, old->slices[sliceOf (n - j, old->age)], old->planes, old->box, rect);
 			}
 		}
+
+		for (unsigned int o = 0; o < levels.size(); o++) { if (lastUse[o] == (int) l) { levels[o].slices.clear(); } }
+	}
+
+	levels.swap (newLevels);
+	std::cout << "retained: " << levels.size() << " levels / " << (bytes >> 20) << " MB" << std::endl;
+}
+
+
+
+
+// Take [firstRow, lastRow) x [firstCol, lastCol) from the frame workingDelay
+// slots after currentDelay
+void addBand (unsigned int firstRow, unsigned int lastRow, unsigned int firstCol, unsigned int lastCol)
+{
+	lastRow = std::min (lastRow, frameHeight);
+	lastCol = std::min (lastCol, frameWidth);
+	if (firstRow >= lastRow || firstCol >= lastCol) { return; }
+
+	delayMap (cv::Rect (firstCol, firstRow, lastCol - firstCol, lastRow - firstRow)).setTo (cv::Scalar (workingDelay));
+}
+
+
+// Fill the delay map from a profile giving, for each pixel, a value in [0, 1]
+// going from the oldest frame (0) to the newest one (1). Reverse swaps the
+// two ends; symmetric folds the profile so that both ends are the oldest.
+void computeProfile (float (*profile) (unsigned int r, unsigned int c))
+{
+	for (unsigned int r = 0; r < frameHeight; r++)
+	{
+		unsigned short *offset = delayMap.ptr<unsigned short>(r);
+		for (unsigned int c = 0; c < frameWidth; c++)
+		{
+			float v = profile (r, c);
+			if (reverse) { v = 1 - v; }
+			if (symmetric) { v = 1 - fabs (2*v - 1); }
+
+			unsigned int d = v * delay;
+			offset[c] = std::min (d, delay-1);
+		}
+	}
+}
+
+
+// Oldest frame in the centre, newest in the corners
+float radialProfile (unsigned int r, unsigned int c)
+{
+	float x = (c + 0.5f) / frameWidth - 0.5f;
+	float y = (r + 0.5f) / frameHeight - 0.5f;
+	return sqrt (2 * (x*x + y*y));
+}
+
+
+// Oldest frame in the top left corner, newest in the bottom right one
+float diagonalProfile (unsigned int r, unsigned int c)
+{
+	return ((float) r / frameHeight + (float) c / frameWidth) / 2;
+}
+
+
+// Black pixels of the map image show the oldest frame, white ones the newest
+float imageProfile (unsigned int r, unsigned int c)
+{
+	return mapImage.at<uchar>(r, c) / 256.f;
+}
+
+
+
+
+void computeVertical ()
+{
+	workingDelay = 0;
+	float firstCol = ((float) frameWidth / (float) delay);
+	
+	for (unsigned int d = 1; d < delay; d++)
+	{
+		workingDelay++;
+		float lastCol = (d+1) * ((float) frameWidth / (float) delay);
+
+		addBand (0, frameHeight, (unsigned int) firstCol, (unsigned int) lastCol);
+		firstCol = lastCol;
+	}
+}
+
+
+void computeVerticalSymmetric ()
+{
+	workingDelay = delay/2;
+	float firstCol = ((float) frameWidth / (float) delay);
+	
+	for (unsigned int d = 1; d < delay/2; d++)
+	{
+		workingDelay++;
+		float lastCol = (d+1) * ((float) frameWidth / (float) delay);
+
+		// Columns c in [firstCol, lastCol) and their mirrors (frameWidth-1) - c
+		addBand (0, frameHeight, (unsigned int) firstCol, (unsigned int) lastCol);
+		addBand (0, frameHeight, frameWidth - (unsigned int) lastCol, frameWidth - (unsigned int) firstCol);
+		firstCol = lastCol;
+	}
+}
+
+
+void computeVerticalReverse ()
+{
+	workingDelay = 0;
+	float firstCol = (delay-1) * ((float) frameWidth / (float) delay);
+	
+	for (unsigned int d = 1; d < delay; d++)
+	{
+		workingDelay++;
+		float lastCol = (delay-(d+1)) * ((float) frameWidth / (float) delay);
+
+		// Columns c in (lastCol, firstCol]
+		addBand (0, frameHeight, (unsigned int) lastCol + 1, (unsigned int) firstCol + 1);
 		firstCol = lastCol;
 	}
+}
+
+
+void computeVerticalReverseSymmetric ()
+{
+	workingDelay = delay/2;
+	float firstCol = (delay-1) * ((float) frameWidth / (float) delay);
+	
+	for (unsigned int d = 1; d < delay/2; d++)
+	{
+		workingDelay++;
+		float lastCol = (delay/2-(d+1)) * ((float) frameWidth / (float) delay);
 
-	if (parallelComputation) { pthread_exit (NULL); }
+		// Columns c in (lastCol, firstCol] and their mirrors frameWidth - c
+		addBand (0, frameHeight, (unsigned int) lastCol + 1, (unsigned int) firstCol + 1);
+		addBand (0, frameHeight, frameWidth - (unsigned int) firstCol, frameWidth - (unsigned int) lastCol);
+		firstCol = lastCol;
+	}
 }
 
 
 
 
-void *computeHorizontal (void *arg)
+void computeHorizontal ()
 {
-	workingDelay = currentDelay; // + (maxDelay - delay);
-	//if (workingDelay >= maxDelay+2) { workingDelay -= (maxDelay+2); }
+	workingDelay = 0; // + (maxDelay - delay);
 	float firstRow = ((float) frameHeight / (float) delay);
 	
 	for (unsigned int d = 1; d < delay; d++)
 	{
 		workingDelay++;
-		if (workingDelay >= maxDelay+2) { workingDelay = 0; }
-		workingPixel = frameArray[workingDelay].ptr<cv::Vec3b>(0);
-
 		float lastRow = (d+1) * ((float) frameHeight / (float) delay);
 
-		for (unsigned int r = (unsigned int) firstRow; r < (unsigned int) lastRow; r++)
-		{
-			unsigned int i = r * frameWidth;
-			for (unsigned int c = 0; c < frameWidth; c++)
-			{
-				currentPixel[i][0] = workingPixel[i][0];
-				currentPixel[i][1] = workingPixel[i][1];
-				currentPixel[i][2] = workingPixel[i][2];
-				i++;
-			}
-		}
+		addBand ((unsigned int) firstRow, (unsigned int) lastRow, 0, frameWidth);
 		firstRow = lastRow;
 	}
-
-	if (parallelComputation) { pthread_exit (NULL); }
 }
 
 
-void *computeHorizontalSymmetric (void *arg)
+void computeHorizontalSymmetric ()
 {
-	workingDelay = currentDelay + delay/2;
-	if (workingDelay >= maxDelay+2) { workingDelay -= (maxDelay+2); }	
+	workingDelay = delay/2;
 	float firstRow = ((float) frameHeight / (float) delay);
 	
 	for (unsigned int d = 1; d < delay/2; d++)
 	{
 		workingDelay++;
-		if (workingDelay >= maxDelay+2) { workingDelay = 0; }
-		workingPixel = frameArray[workingDelay].ptr<cv::Vec3b>(0);
-
 		float lastRow = (d+1) * ((float) frameHeight / (float) delay);
 
-		for (unsigned int r = (unsigned int) firstRow; r < (unsigned int) lastRow; r++)
-		{
-			unsigned int i = r * frameWidth;
-			for (unsigned int c = 0; c < frameWidth; c++)
-			{
-				currentPixel[i][0] = workingPixel[i][0];
-				currentPixel[i][1] = workingPixel[i][1];
-				currentPixel[i][2] = workingPixel[i][2];
-				i++;
-			}
-
-			i = (frameHeight - r) * frameWidth;
-			for (unsigned int c = 0; c < frameWidth; c++)
-			{
-				currentPixel[i][0] = workingPixel[i][0];
-				currentPixel[i][1] = workingPixel[i][1];
-				currentPixel[i][2] = workingPixel[i][2];
-				i++;
-			}
-		}
+		// Rows r in [firstRow, lastRow) and their mirrors frameHeight - r
+		addBand ((unsigned int) firstRow, (unsigned int) lastRow, 0, frameWidth);
+		addBand (frameHeight - (unsigned int) lastRow + 1, frameHeight - (unsigned int) firstRow + 1, 0, frameWidth);
 		firstRow = lastRow;
 	}
-
-	if (parallelComputation) { pthread_exit (NULL); }
 }
 
 
-void *computeHorizontalSymmetricBis (void *arg)
+void computeHorizontalSymmetricBis ()
 {
-	workingDelay = currentDelay;
+	workingDelay = 0;
 	float firstRow = ((float) frameHeight / (float) delay);
 	
 	for (unsigned int d = 1; d < delay; d++)
 	{
 		workingDelay++;
-		if (workingDelay >= maxDelay+2) { workingDelay = 0; }
-		workingPixel = frameArray[workingDelay].ptr<cv::Vec3b>(0);
-
 		float lastRow = (d+1) * ((float) frameHeight / (float) delay);
 
-		for (unsigned int r = (unsigned int) firstRow; r < (unsigned int) lastRow; r++)
-		{
-			unsigned int i = r * frameWidth;
-			for (unsigned int c = 0; c < frameWidth/2; c++)
-			{
-				currentPixel[i][0] = workingPixel[i][0];
-				currentPixel[i][1] = workingPixel[i][1];
-				currentPixel[i][2] = workingPixel[i][2];
-				i++;
-			}
-		}
+		addBand ((unsigned int) firstRow, (unsigned int) lastRow, 0, frameWidth/2);
 		firstRow = lastRow;
 	}
 
-	workingDelay = currentDelay;
+	workingDelay = 0;
 	firstRow = (delay-1) * ((float) frameHeight / (float) delay);
 	
 	for (unsigned int d = 1; d < delay; d++)
 	{
 		workingDelay++;
-		if (workingDelay >= maxDelay+2) { workingDelay = 0; }
-		workingPixel = frameArray[workingDelay].ptr<cv::Vec3b>(0);
-
 		float lastRow = (delay-(d+1)) * ((float) frameHeight / (float) delay);
 
-		for (unsigned int r = (unsigned int) firstRow; r > (unsigned int) lastRow; r--)
-		{
-			unsigned int i = r * frameWidth + frameWidth/2;
-			for (unsigned int c = 0; c < frameWidth/2; c++)
-			{
-				currentPixel[i][0] = workingPixel[i][0];
-				currentPixel[i][1] = workingPixel[i][1];
-				currentPixel[i][2] = workingPixel[i][2];
-				i++;
-			}
-		}
+		// Rows r in (lastRow, firstRow]
+		addBand ((unsigned int) lastRow + 1, (unsigned int) firstRow + 1, frameWidth/2, frameWidth/2 + frameWidth/2);
 		firstRow = lastRow;
 	}
-
-	if (parallelComputation) { pthread_exit (NULL); }
 }
 
 
-void *computeHorizontalReverse (void *arg)
+void computeHorizontalReverse ()
 {
-	workingDelay = currentDelay;
+	workingDelay = 0;
 	float firstRow = (delay-1) * ((float) frameHeight / (float) delay);
 	
 	for (unsigned int d = 1; d < delay; d++)
 	{
 		workingDelay++;
-		if (workingDelay >= maxDelay+2) { workingDelay = 0; }
-		workingPixel = frameArray[workingDelay].ptr<cv::Vec3b>(0);
-
 		float lastRow = (delay-(d+1)) * ((float) frameHeight / (float) delay);
 
-		for (unsigned int r = (unsigned int) firstRow; r > (unsigned int) lastRow; r--)
-		{
-			unsigned int i = r * frameWidth;
-			for (unsigned int c = 0; c < frameWidth; c++)
-			{
-				currentPixel[i][0] = workingPixel[i][0];
-				currentPixel[i][1] = workingPixel[i][1];
-				currentPixel[i][2] = workingPixel[i][2];
-				i++;
-			}
-		}
+		// Rows r in (lastRow, firstRow]
+		addBand ((unsigned int) lastRow + 1, (unsigned int) firstRow + 1, 0, frameWidth);
 		firstRow = lastRow;
 	}
-
-	if (parallelComputation) { pthread_exit (NULL); }
 }
 
 
-void *computeHorizontalReverseSymmetric (void *arg)
+void computeHorizontalReverseSymmetric ()
 {
-	workingDelay = currentDelay + delay/2;
-	if (workingDelay >= maxDelay+2) { workingDelay -= (maxDelay+2); }	
+	workingDelay = delay/2;
 	float firstRow = (delay-1) * ((float) frameHeight / (float) delay);
 	
-	for (unsigned int d = 1; d < delay; d++)
+	// Like computeVerticalReverseSymmetric, stop at delay/2: further bands
+	// have wrapped-around (negative) row bounds and would read frames more
+	// recent than the newest captured one
+	for (unsigned int d = 1; d < delay/2; d++)
 	{
 		workingDelay++;
-		if (workingDelay >= maxDelay+2) { workingDelay = 0; }
-		workingPixel = frameArray[workingDelay].ptr<cv::Vec3b>(0);
-
 		float lastRow = (delay/2-(d+1)) * ((float) frameHeight / (float) delay);
 
-		for (unsigned int r = (unsigned int) firstRow; r > (unsigned int) lastRow; r--)
-		{
-			unsigned int i = r * frameWidth;
-			for (unsigned int c = 0; c < frameWidth; c++)
-			{
-				currentPixel[i][0] = workingPixel[i][0];
-				currentPixel[i][1] = workingPixel[i][1];
-				currentPixel[i][2] = workingPixel[i][2];
-				i++;
-			}
-
-			i = (frameHeight - r) * frameWidth;
-			for (unsigned int c = 0; c < frameWidth; c++)
-			{
-				currentPixel[i][0] = workingPixel[i][0];
-				currentPixel[i][1] = workingPixel[i][1];
-				currentPixel[i][2] = workingPixel[i][2];
-				i++;
-			}
-		}
+		// Rows r in (lastRow, firstRow] and their mirrors frameHeight - r
+		addBand ((unsigned int) lastRow + 1, (unsigned int) firstRow + 1, 0, frameWidth);
+		addBand (frameHeight - (unsigned int) firstRow, frameHeight - (unsigned int) lastRow, 0, frameWidth);
 		firstRow = lastRow;
 	}
-
-	if (parallelComputation) { pthread_exit (NULL); }
 }
 